@@ -0,0 +1,396 @@
+/*
+
+ archive.c - Read only access to the members of .zip and .tar archives
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "archive.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef VFS
+#include <zlib.h>
+#endif
+
+#define ARCHIVE_BLOCK 65536
+#define ARCHIVE_CURSORS 4
+
+enum {
+    AM_STORED = 0,
+    AM_DEFLATED = 8
+};
+
+static unsigned long le(const unsigned char *p, int len) {
+    unsigned long v = 0;
+    while (len--) v = (v << 8) | p[len];
+    return v;
+}
+
+static unsigned long long le64(const unsigned char *p) {
+    return ((unsigned long long)le(p + 4, 4) << 32) | le(p, 4);
+}
+
+static int probe(const char *name, size_t len) {
+    return vfs_extension(name, len, "zip") || vfs_extension(name, len, "tar");
+}
+
+static time_t dostime(unsigned int time, unsigned int date) {
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    tm.tm_sec = (time & 31) * 2;
+    tm.tm_min = (time >> 5) & 63;
+    tm.tm_hour = time >> 11;
+    tm.tm_mday = date & 31;
+    tm.tm_mon = ((date >> 5) & 15) - 1;
+    tm.tm_year = (date >> 9) + 80;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static int zip_load(Vfs_container *c) {
+    const unsigned char *d = c->data, *p;
+    unsigned long long count, size, offset, i;
+    size_t end;
+
+    if (c->datalen < 22) return -1;
+    for (end = c->datalen - 22;; end--) {
+        if (le(d + end, 4) == 0x06054b50) break;
+        if (end == 0 || c->datalen - end > 65557) return -1;
+    }
+    p = d + end;
+    count = le(p + 10, 2);
+    size = le(p + 12, 4);
+    offset = le(p + 16, 4);
+    if ((count == 0xffff || size == 0xffffffff || offset == 0xffffffff) && end >= 20 && le(p - 20, 4) == 0x07064b50) {
+        unsigned long long z = le64(p - 12);
+        if (z + 56 > c->datalen || le(d + z, 4) != 0x06064b50) return -1;
+        count = le64(d + z + 32);
+        size = le64(d + z + 40);
+        offset = le64(d + z + 48);
+    }
+    if (offset > c->datalen || size > c->datalen - offset) return -1;
+
+    p = d + offset;
+    for (i = 0; i < count; i++) {
+        unsigned int namelen, extralen, flags, method;
+        unsigned long long csize, usize, local;
+        const unsigned char *x;
+        int n;
+
+        if ((size_t)(p - d) + 46 > offset + size || le(p, 4) != 0x02014b50) return -1;
+        flags = le(p + 8, 2);
+        method = le(p + 10, 2);
+        csize = le(p + 20, 4);
+        usize = le(p + 24, 4);
+        namelen = le(p + 28, 2);
+        extralen = le(p + 30, 2);
+        local = le(p + 42, 4);
+        if ((size_t)(p - d) + 46 + namelen + extralen > offset + size) return -1;
+
+        for (x = p + 46 + namelen; x + 4 <= p + 46 + namelen + extralen; x += 4 + le(x + 2, 2)) {
+            const unsigned char *f = x + 4, *fe = f + le(x + 2, 2);
+            if (le(x, 2) != 1) continue;
+            if (usize == 0xffffffff && f + 8 <= fe) { usize = le64(f); f += 8; }
+            if (csize == 0xffffffff && f + 8 <= fe) { csize = le64(f); f += 8; }
+            if (local == 0xffffffff && f + 8 <= fe) { local = le64(f); f += 8; }
+            break;
+        }
+
+        if (namelen != 0 && p[46 + namelen - 1] == '/') {
+            vfs_add(c, (const char *)p + 46, namelen, 1, 0, dostime(le(p + 12, 2), le(p + 14, 2)));
+        } else if ((flags & 1) == 0 && (method == AM_STORED || method == AM_DEFLATED)
+                && local + 30 <= c->datalen && le(d + local, 4) == 0x04034b50) {
+            unsigned long long data = local + 30 + le(d + local + 26, 2) + le(d + local + 28, 2);
+            if (data <= c->datalen && csize <= c->datalen - data && (method != AM_STORED || csize == usize)) {
+                n = vfs_add(c, (const char *)p + 46, namelen, 0, usize, dostime(le(p + 12, 2), le(p + 14, 2)));
+                if (n >= 0) {
+                    c->entries[n].offset = data;
+                    c->entries[n].length = csize;
+                    c->entries[n].method = method;
+                }
+            }
+        }
+        p += 46 + namelen + extralen + le(p + 32, 2);
+    }
+    return 0;
+}
+
+static unsigned long long octal(const unsigned char *p, size_t len) {
+    unsigned long long v = 0;
+    if (*p & 0x80) {
+        v = *p++ & 0x7f;
+        while (--len) v = (v << 8) | *p++;
+        return v;
+    }
+    while (len != 0 && *p == ' ') { p++; len--; }
+    while (len != 0 && *p >= '0' && *p <= '7') {
+        v = v * 8 + *p++ - '0';
+        len--;
+    }
+    return v;
+}
+
+static size_t field(const unsigned char *p, size_t len) {
+    const unsigned char *e = (const unsigned char *)memchr(p, 0, len);
+    return e != NULL ? (size_t)(e - p) : len;
+}
+
+static int tar_load(Vfs_container *c) {
+    const unsigned char *d = c->data;
+    size_t pos = 0;
+    char *longname = NULL;
+    size_t longlen = 0;
+    unsigned long long longsize = 0;
+    int havesize = 0;
+
+    while (pos + 512 <= c->datalen) {
+        const unsigned char *h = d + pos;
+        unsigned long long size, sum = 0;
+        unsigned int i;
+        char name[256];
+        size_t len;
+        const char *n;
+
+        if (h[0] == 0) break;
+        for (i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : h[i];
+        if (sum != octal(h + 148, 8)) {
+            free(longname);
+            return pos == 0 ? -1 : 0;
+        }
+        size = havesize ? longsize : octal(h + 124, 12);
+        havesize = 0;
+        pos += 512;
+        if (size > c->datalen - pos) break;
+
+        switch (h[156]) {
+        case 'L':
+        case 'x':
+            free(longname);
+            longname = NULL;
+            if (h[156] == 'L') {
+                longlen = field(d + pos, size);
+                longname = (char *)malloc(longlen + 1);
+                if (longname != NULL) memcpy(longname, d + pos, longlen);
+            } else {
+                const char *r = (const char *)d + pos, *e = r + size;
+                while (r < e) {
+                    char *k;
+                    unsigned long l = strtoul(r, &k, 10);
+                    if (l == 0 || k >= e || *k != ' ' || l > (unsigned long)(e - r)) break;
+                    k++;
+                    if (!strncmp(k, "path=", 5)) {
+                        free(longname);
+                        longlen = r + l - 1 - (k + 5);
+                        longname = (char *)malloc(longlen + 1);
+                        if (longname != NULL) memcpy(longname, k + 5, longlen);
+                    } else if (!strncmp(k, "size=", 5)) {
+                        longsize = strtoull(k + 5, NULL, 10);
+                        havesize = 1;
+                    }
+                    r += l;
+                }
+            }
+            pos += (size + 511) & ~(unsigned long long)511;
+            continue;
+        default:
+            break;
+        }
+
+        if (longname != NULL) {
+            n = longname;
+            len = longlen;
+        } else {
+            len = 0;
+            if (!memcmp(h + 257, "ustar", 5) && h[345] != 0) {
+                len = field(h + 345, 155);
+                memcpy(name, h + 345, len);
+                name[len++] = '/';
+            }
+            memcpy(name + len, h, field(h, 100));
+            len += field(h, 100);
+            n = name;
+        }
+
+        switch (h[156]) {
+        case '5':
+            vfs_add(c, n, len, 1, 0, octal(h + 136, 12));
+            size = 0;
+            break;
+        case '0':
+        case '7':
+        case 0:
+            if (len != 0 && n[len - 1] == '/') {
+                vfs_add(c, n, len, 1, 0, octal(h + 136, 12));
+            } else {
+                int e = vfs_add(c, n, len, 0, size, octal(h + 136, 12));
+                if (e >= 0) {
+                    c->entries[e].offset = pos;
+                    c->entries[e].length = size;
+                    c->entries[e].method = AM_STORED;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+        free(longname);
+        longname = NULL;
+        pos += (size + 511) & ~(unsigned long long)511;
+    }
+    free(longname);
+    return 0;
+}
+
+static int load(Vfs_container *c) {
+    if (vfs_extension(c->path, strlen(c->path), "zip")) return zip_load(c);
+    return tar_load(c);
+}
+
+#ifdef VFS
+typedef struct Cursor {
+    const Vfs_container *container;
+    int entry;
+    unsigned long index;
+    unsigned long used;
+    unsigned long long consumed;
+    int active;
+    z_stream zs;
+} Cursor;
+
+static Cursor cursors[ARCHIVE_CURSORS];
+static unsigned long tick;
+
+static Cursor *cursor_get(const Vfs_container *c, int entry, unsigned long index) {
+    unsigned int i, slot = 0;
+    Cursor *cursor;
+    for (i = 0; i < ARCHIVE_CURSORS; i++) {
+        cursor = cursors + i;
+        if (cursor->active && cursor->container == c && cursor->entry == entry && cursor->index <= index) return cursor;
+        if (!cursor->active) {
+            if (cursors[slot].active) slot = i;
+        } else if (cursors[slot].active && cursor->used < cursors[slot].used) slot = i;
+    }
+    cursor = cursors + slot;
+    if (cursor->active) inflateEnd(&cursor->zs);
+    memset(&cursor->zs, 0, sizeof cursor->zs);
+    cursor->active = 0;
+    if (inflateInit2(&cursor->zs, -MAX_WBITS) != Z_OK) return NULL;
+    cursor->active = 1;
+    cursor->container = c;
+    cursor->entry = entry;
+    cursor->index = 0;
+    cursor->consumed = 0;
+    return cursor;
+}
+
+static const Vfs_block *block_get(const Vfs_container *c, const Vfs_entry *e, unsigned long index) {
+    int entry = e - c->entries;
+    Cursor *cursor;
+    Vfs_block *b = vfs_block(c, entry, index);
+
+    if (b != NULL) return b;
+    cursor = cursor_get(c, entry, index);
+    if (cursor == NULL) return NULL;
+    cursor->used = ++tick;
+    for (;;) {
+        static unsigned char scratch[ARCHIVE_BLOCK];
+        int ret = Z_OK, fresh = 0;
+        b = vfs_block(c, entry, cursor->index);
+        if (b == NULL) {
+            b = vfs_block_new(c, entry, cursor->index, ARCHIVE_BLOCK);
+            if (b == NULL) return NULL;
+            fresh = 1;
+        }
+        cursor->zs.next_out = fresh ? b->data : scratch;
+        cursor->zs.avail_out = ARCHIVE_BLOCK;
+        while (cursor->zs.avail_out != 0 && ret == Z_OK) {
+            if (cursor->zs.avail_in == 0) {
+                unsigned long long left = e->length - cursor->consumed;
+                cursor->zs.next_in = c->data + e->offset + cursor->consumed;
+                cursor->zs.avail_in = left > 0x40000000 ? 0x40000000 : left;
+                cursor->consumed += cursor->zs.avail_in;
+            }
+            ret = inflate(&cursor->zs, Z_NO_FLUSH);
+            if (ret == Z_BUF_ERROR && cursor->zs.avail_in == 0) break;
+        }
+        if (fresh) b->length = ARCHIVE_BLOCK - cursor->zs.avail_out;
+        if (ret != Z_OK || cursor->zs.avail_out != 0) {
+            inflateEnd(&cursor->zs);
+            cursor->active = 0;
+            if (cursor->zs.avail_out == ARCHIVE_BLOCK || (ret != Z_STREAM_END && ret != Z_OK)) {
+                if (fresh) vfs_block_free(b);
+                return NULL;
+            }
+        }
+        if (fresh) vfs_block_share(b);
+        if (cursor->index++ == index) return b;
+        if (!cursor->active) return NULL;
+    }
+}
+
+static size_t read_data(Vfs_container *c, const Vfs_entry *e, unsigned long pos, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    if (e->method == AM_STORED) {
+        memcpy(buf, c->data + e->offset + pos, len);
+        return len;
+    }
+    while (done < len) {
+        const Vfs_block *b = block_get(c, e, pos / ARCHIVE_BLOCK);
+        unsigned long in = pos % ARCHIVE_BLOCK, l;
+        if (b == NULL || in >= b->length) break;
+        l = b->length - in;
+        if (l > len - done) l = len - done;
+        memcpy(buf + done, b->data + in, l);
+        done += l;
+        pos += l;
+    }
+    return done;
+}
+
+static void release(Vfs_container *c) {
+    unsigned int i;
+    for (i = 0; i < ARCHIVE_CURSORS; i++) {
+        if (cursors[i].active && cursors[i].container == c) {
+            inflateEnd(&cursors[i].zs);
+            cursors[i].active = 0;
+        }
+    }
+}
+#else
+static size_t read_data(Vfs_container *c, const Vfs_entry *e, unsigned long pos, unsigned char *buf, size_t len) {
+    if (e->method != AM_STORED) return 0;
+    memcpy(buf, c->data + e->offset + pos, len);
+    return len;
+}
+
+static void release(Vfs_container *c) {
+    (void)c;
+}
+#endif
+
+static const Vfs_backend backend = {
+    probe,
+    load,
+    read_data,
+    release,
+    0
+};
+
+const Vfs_backend *archive_backend(void) {
+    return &backend;
+}
@@ -25,9 +25,31 @@
 
 #include "arguments.h"
 #include <stdlib.h>
+#include <string.h>
 #include "getopt.h"
 #include "message.h"
 
+int arguments_size(const char *text, unsigned long *size) {
+    char *end;
+    *size = strtoul(text, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': *size <<= 10; end++; break;
+    case 'm': case 'M': *size <<= 20; end++; break;
+    case 'g': case 'G': *size <<= 30; end++; break;
+    }
+    return (*end != 0 || *size == 0) ? -1 : 0;
+}
+
+int arguments_sync(const char *text, Syncmode *syncmode, unsigned int *syncinterval) {
+    if (!strcmp(text, "none")) *syncmode = SYNC_NONE;
+    else if (!strcmp(text, "on-close")) *syncmode = SYNC_ON_CLOSE;
+    else if (!strncmp(text, "interval", 8) && (text[8] == 0 || text[8] == ':')) {
+        *syncmode = SYNC_INTERVAL;
+        *syncinterval = text[8] ? strtol(text + 9, NULL, 0) : 5;
+    } else return -1;
+    return 0;
+}
+
 void testarg(Arguments *arguments, int argc, char *argv[]) {
     int c;
 
@@ -43,8 +65,12 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
             {"user", required_argument, NULL, 'u'},
             {"group", required_argument, NULL, 'g'},
             {"nice", required_argument, NULL, 'n'},
+            {"metrics", required_argument, NULL, 'M'},
+            {"ramdisk", required_argument, NULL, 'R'},
+            {"prealloc", no_argument, NULL, 'a'},
 #endif
             {"root", required_argument, NULL, 'r'},
+            {"partitions", required_argument, NULL, 'c'},
             {"log", required_argument, NULL, 'l'},
             {"allprg", no_argument, NULL, 'P'},
             {"dot-type", no_argument, NULL, 'F'},
@@ -60,17 +86,19 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
             {"lptport", required_argument, NULL, 'p'},
             {"ipaddress", required_argument, NULL, 'i'},
             {"network", required_argument, NULL, 'N'},
+            {"sync", required_argument, NULL, 'S'},
+            {"trace", required_argument, NULL, 'T'},
             {NULL, no_argument, NULL, 0}
         };
         int option_index = 0;
 
         c = getopt_long(argc, argv,
 #if defined WIN32
-                        "m:r:l:CFP?VbhvDd:p:i:N:"
+                        "m:r:l:c:CFP?VbhvDd:p:i:N:S:T:"
 #elif defined __DJGPP__
-                        "m:r:l:CFP?VhvDd:p:i:N:"
+                        "m:r:l:c:CFP?VhvDd:p:i:N:S:T:"
 #else
-                        "m:u:g:r:l:n:CFP?VbhvDd:p:i:N:"
+                        "m:u:g:r:l:c:n:CFP?VbhvDd:p:i:N:S:aM:R:T:"
 #endif
                         , long_options, &option_index);
         if (c == -1) {
@@ -86,15 +114,19 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
                    "\n"
 #if defined WIN32
                    "  -b, --background\t     Fork into background\n"
+                   "  -c, --partitions=FILE\t     Partition map\n"
                    "  -C, --comma-type\t     Create comma file types\n"
                    "  -d, --device=COMx\t     Serial port device (COM1)\n"
                    "  -F, --dot-type\t     Create dot file types\n"
 #elif defined __DJGPP__
+                   "  -c, --partitions=FILE\t     Partition map\n"
                    "  -C, --comma-type\t     Create comma file types\n"
                    "  -d, --device=COMx\t     Serial port device (COM1)\n"
                    "  -F, --dot-type\t     Create dot file types\n"
 #else
+                   "  -a, --prealloc\t     Preallocate written files (ext4 nodelalloc)\n"
                    "  -b, --background\t     Fork into background\n"
+                   "  -c, --partitions=FILE\t     Partition map\n"
                    "  -C, --comma-type\t     Create comma file types\n"
                    "  -d, --device=DEVICE\t     Device (/dev/parport0 or /dev/ttyS0)\n"
                    "  -F, --dot-type\t     Create dot file types\n"
@@ -104,9 +136,11 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
                    "  -i, --ipaddress=IP\t     IP address of C64 on network\n"
                    "  -l, --log=FILE\t     Logfile (stdout)\n"
                    "  -m, --mode=MODE\t     Mode (x1541, xe1541, xm1541, xa1541,\n"
-                   "\t\t\t     pc64, pc64s, rs232, rs232s, usb, vice, eth)\n"
+                   "\t\t\t     pc64, pc64s, rs232, rs232s, usb, usblisten,\n"
+                   "\t\t\t     vice, vicelisten, eth, shm, replay, replayrt)\n"
 #if defined WIN32 || defined __DJGPP__
 #else
+                   "  -M, --metrics=SOCKET\t     Metrics on Unix socket\n"
                    "  -n, --nice=ADJUST\t     Adjust nice level (-19)\n"
 #endif
                    "  -N, --network=NUM\t     Network number (0)\n"
@@ -114,6 +148,14 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
                    "  -P, --allprg\t\t     Almost everything to PRG\n"
                    "  -r, --root=DIRECTORY\t     Root directory (.)\n"
 #if defined WIN32 || defined __DJGPP__
+#else
+                   "  -R, --ramdisk=SIZE\t     RAM disk of SIZE bytes (k, M, G) as\n"
+                   "\t\t\t     partition 2\n"
+#endif
+                   "  -S, --sync=POLICY\t     Write durability (none, on-close,\n"
+                   "\t\t\t     interval[:SECONDS]) (none)\n"
+                   "  -T, --trace=PREFIX\t     Record sessions into PREFIX.PID\n"
+#if defined WIN32 || defined __DJGPP__
 #else
                    "  -u, --user=USER\t     User under we run (nobody)\n"
 #endif
@@ -132,23 +174,28 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
             message(
 #ifdef WIN32
                    "Usage: ideservd [-CFhPv?V] [-m MODE] [-d COMx] [-p IOPORT] [-i IP] [-N NUM]\n"
-                   "        [-r DIRECTORY] [-l FILE] [--mode MODE] [--allprg] [--comma-type]\n"
-                   "        [--dot-type] [--device DEVICE] [--lptport=IOPORT] [--ipaddress IP]\n"
-                   "        [--network NUM] [--root=DIRECTORY] [--background] [--log=FILE] [--hog]\n"
-                   "        [--verbose] [--help] [--usage] [--version]\n"
+                   "        [-r DIRECTORY] [-l FILE] [-c FILE] [-S POLICY] [-T PREFIX]\n"
+                   "        [--mode MODE] [--allprg] [--comma-type] [--dot-type] [--device DEVICE]\n"
+                   "        [--lptport=IOPORT] [--ipaddress IP] [--network NUM] [--root=DIRECTORY]\n"
+                   "        [--partitions=FILE] [--background] [--log=FILE] [--hog] [--sync=POLICY]\n"
+                   "        [--trace=PREFIX] [--verbose] [--help] [--usage] [--version]\n"
 #elif defined __DJGPP__
                    "Usage: ideservd [-CFhPv?V] [-m MODE] [-d COMx] [-p IOPORT] [-i IP] [-N NUM]\n"
-                   "        [-r DIRECTORY] [-l FILE] [--mode MODE] [--allprg] [--comma-type]\n"
-                   "        [--dot-type] [--device DEVICE] [--lptport=IOPORT] [--ipaddress IP]\n"
-                   "        [--network NUM] [--root=DIRECTORY] [--log=FILE] [--hog] [--verbose]\n"
-                   "        [--help] [--usage] [--version]\n"
-#else
-                   "Usage: ideservd [-bCFhPv?V] [-m MODE] [-d DEVICE] [-p IOPORT] [-i IP] [-N NUM]\n"
-                   "        [-r DIRECTORY] [-l FILE] [-u USER] [-g GROUP] [-n ADJUST] [--mode MODE]\n"
-                   "        [--allprg] [--comma-type] [--dot-type] [--device DEVICE]\n"
+                   "        [-r DIRECTORY] [-l FILE] [-c FILE] [-S POLICY] [-T PREFIX]\n"
+                   "        [--mode MODE] [--allprg] [--comma-type] [--dot-type] [--device DEVICE]\n"
                    "        [--lptport=IOPORT] [--ipaddress IP] [--network NUM] [--root=DIRECTORY]\n"
-                   "        [--group=GROUP] [--user=USER] [--background] [--log=FILE]\n"
-                   "        [--nice=ADJUST] [--hog] [--verbose] [--help] [--usage] [--version]\n"
+                   "        [--partitions=FILE] [--log=FILE] [--hog] [--sync=POLICY]\n"
+                   "        [--trace=PREFIX] [--verbose] [--help] [--usage] [--version]\n"
+#else
+                   "Usage: ideservd [-abCFhPv?V] [-m MODE] [-d DEVICE] [-p IOPORT] [-i IP] [-N NUM]\n"
+                   "        [-r DIRECTORY] [-l FILE] [-c FILE] [-u USER] [-g GROUP] [-n ADJUST]\n"
+                   "        [-S POLICY] [-M SOCKET] [-R SIZE] [-T PREFIX] [--mode MODE] [--allprg]\n"
+                   "        [--comma-type] [--dot-type] [--device DEVICE] [--lptport=IOPORT]\n"
+                   "        [--ipaddress IP] [--network NUM] [--root=DIRECTORY]\n"
+                   "        [--partitions=FILE] [--group=GROUP]\n"
+                   "        [--user=USER] [--background] [--log=FILE] [--nice=ADJUST] [--hog]\n"
+                   "        [--sync=POLICY] [--prealloc] [--metrics=SOCKET] [--ramdisk=SIZE]\n"
+                   "        [--trace=PREFIX] [--verbose] [--help] [--usage] [--version]\n"
 #endif
                   );
             exit(EXIT_SUCCESS);
@@ -163,6 +210,14 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
         case 'u': arguments->user = optarg; break;
         case 'g': arguments->group = optarg; break;
         case 'n': arguments->priority = strtol(optarg, NULL, 0); break;
+        case 'M': arguments->metrics = optarg; break;
+        case 'a': arguments->prealloc = 1; break;
+        case 'R':
+            if (arguments_size(optarg, &arguments->ramdisk)) {
+                message("Invalid RAM disk size \"%s\"\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
 #endif
         case 'C': arguments->nameconversion = NC_FORCECOMMA; break;
         case 'P': arguments->nameconversion = NC_IGNOREDOT; break;
@@ -171,12 +226,20 @@ void testarg(Arguments *arguments, int argc, char *argv[]) {
         case 'v': arguments->verbose = 1; break;
         case 'l': arguments->log = optarg; break;
         case 'r': arguments->root = optarg; break;
+        case 'c': arguments->partitions = optarg; break;
         case 'h': arguments->hog = 1; break;
         case 'd': arguments->device = optarg; break;
         case 'm': arguments->mode_name = optarg; break;
         case 'p': arguments->lptport = strtol(optarg, NULL, 0) & 0xffff; break;
         case 'i': arguments->sin_addr = optarg; break;
         case 'N': arguments->network = strtol(optarg, NULL, 0) & 0xff; break;
+        case 'T': arguments->trace = optarg; break;
+        case 'S':
+            if (arguments_sync(optarg, &arguments->syncmode, &arguments->syncinterval)) {
+                message("Unknown sync policy \"%s\"\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             exit(EXIT_FAILURE);
         }
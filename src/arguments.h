@@ -31,9 +31,14 @@
 
 enum e_modes {
     M_NONE, M_X1541, M_XE1541, M_XM1541, M_XA1541, M_PC64, M_PC64S, M_RS232,
-    M_RS232S, M_USB, M_VICE, M_ETHERNET
+    M_RS232S, M_USB, M_VICE, M_ETHERNET, M_SHM, M_VICELISTEN, M_REPLAY, M_REPLAYRT,
+    M_USBLISTEN
 };
 
+typedef enum Syncmode {
+    SYNC_NONE, SYNC_ON_CLOSE, SYNC_INTERVAL
+} Syncmode;
+
 typedef struct Arguments {
     int background;
     int priority;
@@ -47,11 +52,20 @@ typedef struct Arguments {
     const char *device;
     unsigned short int lptport;
     char *mode_name;
-    enum e_modes mode;
+    enum e_modes mode, protocol;
     char *sin_addr;
     unsigned char network;
+    Syncmode syncmode;
+    unsigned int syncinterval;
+    int prealloc;
+    const char *metrics;
+    const char *trace;
+    unsigned long ramdisk;
+    const char *partitions;
 } Arguments;
 
+extern int arguments_size(const char *, unsigned long *);
+extern int arguments_sync(const char *, Syncmode *, unsigned int *);
 extern void testarg(Arguments *, int, char *[]);
 
 #endif
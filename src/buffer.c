@@ -22,12 +22,24 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include "buffer.h"
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <malloc.h>
+#endif
 #include "partition.h"
 #include "arguments.h"
 #include "path.h"
+#include "vfs.h"
+#include "ram.h"
 
 #ifdef WIN32
 #define SYSTEMNAME "WIN32"
@@ -39,21 +51,346 @@
 #define SYSTEMNAME "LINUX"
 #endif
 
+#if defined OSX || defined __DJGPP__
+#define fdatasync fsync
+#endif
+
+#ifdef WIN32
+#define aligned_free _aligned_free
+#else
+#define aligned_free free
+#endif
+
+#define WRITE_BEHIND 262144
+#define WRITE_ALIGN 65536
+#define PREALLOC_MIN 1048576
+#define PREALLOC_MAX 67108864
+#define POOL_PAGE 4096
+#define POOL_CLASSES 13
+#define POOL_LIMIT 33554432
+
+static unsigned char *pool[POOL_CLASSES];
+static size_t pooled;
+
+static int pool_class(size_t size) {
+    int i;
+    for (i = 0; i < POOL_CLASSES; i++) {
+        if (((size_t)POOL_PAGE << i) >= size) return i;
+    }
+    return -1;
+}
+
+static unsigned char *pool_get(size_t size, size_t *capacity) {
+    int i = pool_class(size);
+    void *data;
+
+    if (i >= 0) {
+        size = (size_t)POOL_PAGE << i;
+        if (pool[i] != NULL) {
+            data = pool[i];
+            memcpy(&pool[i], data, sizeof pool[i]);
+            pooled -= size;
+            *capacity = size;
+            return (unsigned char *)data;
+        }
+    } else {
+        size_t rounded = (size + POOL_PAGE - 1) & ~(size_t)(POOL_PAGE - 1);
+        if (rounded < size) return NULL;
+        size = rounded;
+    }
+#ifdef WIN32
+    data = _aligned_malloc(size, POOL_PAGE);
+#elif defined __DJGPP__
+    data = memalign(POOL_PAGE, size);
+#else
+    if (posix_memalign(&data, POOL_PAGE, size)) data = NULL;
+#endif
+    if (data != NULL) *capacity = size;
+    return (unsigned char *)data;
+}
+
+static void pool_put(unsigned char *data, size_t capacity) {
+    int i = pool_class(capacity);
+
+    if (i < 0 || ((size_t)POOL_PAGE << i) != capacity || pooled + capacity > POOL_LIMIT) {
+        aligned_free(data);
+        return;
+    }
+    memcpy(data, &pool[i], sizeof pool[i]);
+    pool[i] = data;
+    pooled += capacity;
+}
+
 int buffer_reserve(Buffer *buffer, size_t size) {
-    if (buffer->capacity < size) {
-        unsigned char *data = (unsigned char *)realloc(buffer->data, size);
-        if (data == NULL) return 1; //out of memory?!
-        buffer->data = data;
-        buffer->capacity = size;
+    unsigned char *data;
+    size_t capacity;
+
+    if (buffer->capacity >= size) return 0;
+    if (size / 2 < buffer->capacity) size = buffer->capacity * 2;
+    data = pool_get(size, &capacity);
+    if (data == NULL) return 1; //out of memory?!
+    if (buffer->data != NULL) {
+        memcpy(data, buffer->data, buffer->capacity);
+        pool_put(buffer->data, buffer->capacity);
     }
+    buffer->data = data;
+    buffer->capacity = capacity;
     return 0;
 }
 
+void buffer_release(Buffer *buffer) {
+    if (buffer->data != NULL) pool_put(buffer->data, buffer->capacity);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+}
+
+void buffer_readinit(Buffer *buffer, unsigned char partition) {
+    buffer->partition = partition ? partition : partition_get_current();
+#ifdef POSIX_FADV_WILLNEED
+    if (buffer->fd >= 0 && partition_get_cache(buffer->partition) == CACHE_AHEAD) {
+        posix_fadvise(buffer->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(buffer->fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+void buffer_writeinit(Buffer *buffer, unsigned long offset, int prealloc, unsigned char partition) {
+    buffer->partition = partition ? partition : partition_get_current();
+    buffer->wsize = 0;
+    buffer->woffset = offset;
+    buffer->werror = 0;
+    buffer->written = 0;
+    buffer->synced = time(NULL);
+    buffer->allocated = 0;
+    buffer->prealloc = prealloc;
+}
+
+FILE *buffer_opentemp(Buffer *buffer, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t dirlen = (slash != NULL) ? (size_t)(slash + 1 - path) : 0;
+    char *tmpname = (char *)malloc(dirlen + sizeof TEMPFILE_PREFIX "XXXXXX");
+    char *finalname = strdup(path);
+    FILE *file;
+
+    if (tmpname == NULL || finalname == NULL) {
+        free(tmpname);
+        free(finalname);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(tmpname, path, dirlen);
+    if (ram_path(path)) {
+        static unsigned int serial;
+        do {
+            sprintf(tmpname + dirlen, TEMPFILE_PREFIX "%06u", serial++ % 1000000);
+            file = vfs_fopenw(tmpname, O_CREAT | O_EXCL | O_RDWR, &buffer->fd);
+        } while (file == NULL && errno == EEXIST);
+    } else {
+        mode_t mask;
+        strcpy(tmpname + dirlen, TEMPFILE_PREFIX "XXXXXX");
+        buffer->fd = mkstemp(tmpname);
+        file = NULL;
+        if (buffer->fd >= 0) {
+            mask = umask(0);
+            umask(mask);
+            fchmod(buffer->fd, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) & ~mask);
+            file = fdopen(buffer->fd, "wb+");
+            if (file == NULL) {
+                close(buffer->fd);
+                unlink(tmpname);
+            }
+        }
+    }
+    if (file == NULL) {
+        free(tmpname);
+        free(finalname);
+        return NULL;
+    }
+    buffer->tmpname = tmpname;
+    buffer->finalname = finalname;
+    return file;
+}
+
+#ifdef __linux__
+static void buffer_prealloc(Buffer *buffer, unsigned long end) {
+    unsigned long step, allocated;
+    if (!buffer->prealloc || end <= buffer->allocated) return;
+    step = buffer->allocated;
+    if (step < PREALLOC_MIN) step = PREALLOC_MIN;
+    if (step > PREALLOC_MAX) step = PREALLOC_MAX;
+    allocated = buffer->allocated + step;
+    if (allocated < end) allocated = (end + PREALLOC_MIN - 1) & ~(unsigned long)(PREALLOC_MIN - 1);
+    if (fallocate(buffer->fd, FALLOC_FL_KEEP_SIZE, buffer->allocated, allocated - buffer->allocated)) {
+        buffer->prealloc = 0;
+        return;
+    }
+    buffer->allocated = allocated;
+}
+
+static void buffer_trim(Buffer *buffer) {
+    struct stat st;
+    if (buffer->allocated == 0 || fstat(buffer->fd, &st)) return;
+    if ((unsigned long)st.st_size < buffer->allocated) {
+        fallocate(buffer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size, buffer->allocated - st.st_size);
+    }
+    buffer->allocated = 0;
+}
+#else
+#define buffer_prealloc(a, b) do {} while (0)
+#define buffer_trim(a) do {} while (0)
+#endif
+
+static int buffer_pwrite(Buffer *buffer, size_t size) {
+    size_t done = 0;
+    buffer_prealloc(buffer, buffer->woffset + size);
+    while (done < size) {
+        ssize_t l;
+        if (buffer->fd < 0) {
+            l = size - done;
+            if (fseek(buffer->file, buffer->woffset + done, SEEK_SET) || fwrite(buffer->wdata + done, 1, l, buffer->file) != (size_t)l) l = -1;
+        } else {
+#ifdef __DJGPP__
+            l = (lseek(buffer->fd, buffer->woffset + done, SEEK_SET) < 0) ? -1 : write(buffer->fd, buffer->wdata + done, size - done);
+#else
+            l = pwrite(buffer->fd, buffer->wdata + done, size - done, buffer->woffset + done);
+#endif
+        }
+        if (l <= 0) {
+            if (l < 0 && errno == EINTR) continue;
+            buffer->werror = (l < 0) ? errno : ENOSPC;
+            buffer->wsize = 0;
+            return 1;
+        }
+        done += l;
+    }
+    buffer->woffset += size;
+    buffer->wsize -= size;
+    buffer->written = 1;
+    memmove(buffer->wdata, buffer->wdata + size, buffer->wsize);
+    return 0;
+}
+
+int buffer_write(Buffer *buffer, unsigned long offset, const unsigned char *data, size_t size) {
+    if (buffer->werror != 0) return 1;
+    if (buffer->wsize != 0 && offset != buffer->woffset + buffer->wsize) {
+        if (buffer_pwrite(buffer, buffer->wsize)) return 1;
+    }
+    if (buffer->wsize == 0) buffer->woffset = offset;
+    if (buffer->wdata == NULL) {
+        size_t capacity;
+        buffer->wdata = pool_get(WRITE_BEHIND, &capacity);
+        if (buffer->wdata == NULL) {
+            buffer->werror = ENOMEM;
+            return 1;
+        }
+    }
+    while (size != 0) {
+        size_t l = WRITE_BEHIND - buffer->wsize;
+        if (l > size) l = size;
+        memcpy(buffer->wdata + buffer->wsize, data, l);
+        buffer->wsize += l;
+        data += l; size -= l;
+        if (buffer->wsize == WRITE_BEHIND) {
+            unsigned long end = (buffer->woffset + WRITE_BEHIND) & ~(unsigned long)(WRITE_ALIGN - 1);
+            if (buffer_pwrite(buffer, end - buffer->woffset)) return 1;
+        }
+    }
+    return 0;
+}
+
+int buffer_writeback(Buffer *buffer) {
+    if (buffer->wsize != 0) buffer_pwrite(buffer, buffer->wsize);
+    return buffer->werror != 0;
+}
+
+int buffer_sync(Buffer *buffer, const Arguments *arguments, int closing) {
+    Syncmode syncmode = arguments->syncmode;
+    unsigned int syncinterval = arguments->syncinterval;
+    int sync;
+    if (buffer->wdata == NULL) return buffer->werror != 0;
+    partition_get_sync(buffer->partition, &syncmode, &syncinterval);
+    sync = closing && syncmode != SYNC_NONE;
+    if (syncmode == SYNC_INTERVAL && time(NULL) - buffer->synced >= (time_t)syncinterval) sync = 1;
+    if (!sync && !closing) return 0;
+    if (buffer_writeback(buffer)) return 1;
+    if (sync && buffer->fd >= 0) {
+        if (fdatasync(buffer->fd)) {
+            buffer->werror = errno;
+            return 1;
+        }
+        buffer->synced = time(NULL);
+    }
+    return 0;
+}
+
+static int buffer_rename(Buffer *buffer, const Arguments *arguments) {
+    if (vfs_rename(buffer->tmpname, buffer->finalname, 1)) {
+        buffer->werror = errno;
+        return 1;
+    }
+#if !defined WIN32 && !defined __DJGPP__
+    {
+        Syncmode syncmode = arguments->syncmode;
+        unsigned int syncinterval = arguments->syncinterval;
+        partition_get_sync(buffer->partition, &syncmode, &syncinterval);
+        if (syncmode != SYNC_NONE && buffer->fd >= 0) {
+            char *slash = strrchr(buffer->finalname, '/');
+            int fd;
+            if (slash != NULL) *slash = 0;
+            fd = open((slash != NULL) ? buffer->finalname : ".", O_RDONLY);
+            if (fd >= 0) {
+                fsync(fd);
+                close(fd);
+            }
+        }
+    }
+#else
+    (void)arguments;
+#endif
+    return 0;
+}
+
+int buffer_close(Buffer *buffer, const Arguments *arguments, int commit) {
+    int err = 0;
+    if (buffer->file != NULL) {
+        if (buffer->allocated != 0) {
+            buffer_writeback(buffer);
+            buffer_trim(buffer);
+        }
+        err = buffer_sync(buffer, arguments, 1);
+#ifdef POSIX_FADV_DONTNEED
+        if (buffer->fd >= 0 && partition_get_cache(buffer->partition) == CACHE_NONE) {
+            fflush(buffer->file);
+            posix_fadvise(buffer->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+#endif
+        fclose(buffer->file);
+        buffer->file = NULL;
+    }
+    if (buffer->wdata != NULL) {
+        pool_put(buffer->wdata, WRITE_BEHIND);
+        buffer->wdata = NULL;
+    }
+    buffer->wsize = 0;
+    if (buffer->tmpname != NULL) {
+        if (err || !commit || buffer_rename(buffer, arguments)) {
+            vfs_unlink(buffer->tmpname);
+            err = commit;
+        }
+        free(buffer->tmpname);
+        free(buffer->finalname);
+        buffer->tmpname = buffer->finalname = NULL;
+    }
+    if (err) errno = buffer->werror;
+    buffer->werror = 0;
+    return err;
+}
+
 static int buffer_append(Buffer *buffer, const unsigned char *data, unsigned int size) {
     size_t new_size = buffer->size + size;
     if (new_size < size) return 1; //overflow
-    new_size += 4096;
-    if (new_size < 4096) return 1; //overflow
+    new_size += 1024;
+    if (new_size < 1024) return 1; //overflow
     if (buffer_reserve(buffer, new_size)) return 1; //out of memory?!
     memcpy(buffer->data + buffer->size, data, size);
     buffer->size += size;
@@ -65,6 +402,7 @@ int buffer_cookeddir(Buffer *buffer, Directory *directory, int partition, const
     unsigned char dirline[32];
     Petscii name[17], type[4] = {'*', 0};
     unsigned int sum = 0;
+    int readonly = partition_get_readonly(partition);
 
     if (outname != NULL) convertfilename(outname, '=', name, type, NULL);
     if (name[0] == 0) {
@@ -83,6 +421,7 @@ int buffer_cookeddir(Buffer *buffer, Directory *directory, int partition, const
         if (!matchname(dirent.name, name)) continue;
         if (!matchname(dirent.filetype, type)) continue;
 
+        if (readonly) dirent.attrib &= ~(A_DELETEABLE | A_WRITEABLE);
         sum += directory_entry_cook(&dirent, dirline);
         if (sum > 65535) sum = 65535;
         if (buffer_append(buffer, dirline, 32)) return 1;
@@ -95,8 +434,9 @@ int buffer_cookeddir(Buffer *buffer, Directory *directory, int partition, const
     return buffer_append(buffer, dirline, 32);
 }
 
-int buffer_rawdir(Buffer *buffer, Directory *directory) {
+int buffer_rawdir(Buffer *buffer, Directory *directory, int partition) {
     unsigned char dirline[33];
+    int readonly = partition_get_readonly(partition);
 
     dirline[0] = 'I';
     memset(dirline + 1, 32, 16);
@@ -108,6 +448,7 @@ int buffer_rawdir(Buffer *buffer, Directory *directory) {
 
     while (directory_rawread(directory, dirline))
     {
+        if (readonly) dirline[24] &= ~(A_DELETEABLE | A_WRITEABLE);
         if (buffer_append(buffer, dirline, 32)) return 1;
     }
     return 0;
@@ -25,6 +25,7 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 #include <stdio.h>
+#include <time.h>
 
 typedef enum Buffermode {
     CM_CLOSED, CM_DIR, CM_FILE, CM_COMPAT, CM_ERR
@@ -37,13 +38,29 @@ typedef struct Buffer {
     int fd;
     Buffermode mode;
     unsigned int filesize, filepos;
+    unsigned char *wdata;
+    size_t wsize;
+    unsigned long woffset, allocated;
+    int werror, prealloc, written;
+    unsigned char partition;
+    time_t synced;
+    char *tmpname, *finalname;
 } Buffer;
 
 struct Directory;
+struct Arguments;
 typedef unsigned char Petscii;
 
 extern int buffer_reserve(Buffer *, size_t);
+extern void buffer_release(Buffer *);
+extern void buffer_readinit(Buffer *, unsigned char);
+extern void buffer_writeinit(Buffer *, unsigned long, int, unsigned char);
+extern FILE *buffer_opentemp(Buffer *, const char *);
+extern int buffer_write(Buffer *, unsigned long, const unsigned char *, size_t);
+extern int buffer_writeback(Buffer *);
+extern int buffer_sync(Buffer *, const struct Arguments *, int);
+extern int buffer_close(Buffer *, const struct Arguments *, int);
 extern int buffer_cookeddir(Buffer *, struct Directory *, int, const Petscii *);
-extern int buffer_rawdir(Buffer *, struct Directory *);
+extern int buffer_rawdir(Buffer *, struct Directory *, int);
 extern int buffer_partition(Buffer *);
 #endif
@@ -31,6 +31,8 @@
 #include "arguments.h"
 #include "buffer.h"
 #include "ideservd.h"
+#include "metrics.h"
+#include "vfs.h"
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -39,10 +41,6 @@
 #include <unistd.h>
 #include <errno.h>
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
-
 #define OPEN_RONLY 0
 #define OPEN_STATUS 2
 #define OPEN_WONLY 4
@@ -98,7 +96,7 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
     }
     cmd[fp] = 0;
 
-    if (arguments->mode != M_ETHERNET && usecrc) {
+    if (arguments->protocol != M_ETHERNET && usecrc) {
         if (check_trailer(driver, "Open", usecrc)) return 1;
         if (r != 0) {
             seterror(ER_FRAME_ERROR, 1);
@@ -107,12 +105,13 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
         }
     } else {
         if (driver->done()) return 1;
-        if (arguments->mode != M_ETHERNET && r != 0) {
+        if (arguments->protocol != M_ETHERNET && r != 0) {
             seterror(ER_FRAME_ERROR, 1);
             log_print("Open: Frame error");
             return 1;
         }
     }
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) {
         gettimeofday(&start, NULL);
@@ -122,9 +121,8 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
         log_print("Open:");
         log_hex(cmd);
     }
-    if (buffer->file != NULL) {
-        fclose(buffer->file);
-        buffer->file = NULL;
+    if (buffer->file != NULL && buffer_close(buffer, arguments, 0)) {
+        log_printf("Open: Couldn't write: %s(%d)", strerror(errno), errno);
     }
     buffer->mode = CM_CLOSED;
 
@@ -143,6 +141,7 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
         partition = !strncmp((char *)&cmd[1], "=P", 2);
 
         outname = resolv_path(cmd + 1, outpath, &outpart, arguments->nameconversion);
+        metrics_phase(MP_RESOLVE);
         if (arguments->verbose) log_printf("Open #%d: \"$%s\"", channel, outpath);
 
         if (channel == 1) {
@@ -154,7 +153,7 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
                 log_printf("Open: Couldn't open the directory \"%s\": %s(%d)", outpath, strerror(errno), errno);
                 goto vege;
             }
-            if (buffer_rawdir(buffer, directory)) {
+            if (buffer_rawdir(buffer, directory, outpart)) {
                 errtochannel15(1);
                 log_print("Open: Out of memory");
                 directory_close(directory);
@@ -190,6 +189,7 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
     } else {
         Petscii name[17], type[4] = {'*', 0};
         const Petscii *outname;
+        partition_t outpart = 0;
         unsigned char overwrite;
         char lname[1000], outpath[1020];
         int found = 0;
@@ -206,12 +206,13 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
 
         if (!cmd[0]) goto vege;
 
-        outname = resolv_path(cmd, outpath, NULL, arguments->nameconversion);
+        outname = resolv_path(cmd, outpath, &outpart, arguments->nameconversion);
         if (outname == NULL) {
             seterror(ER_PATH_NOT_FOUND, 0); goto vege;
         }
         if (channel == 1) strcpy((char *)type, "PRG");
         convertfilename(outname, ',', name, type, &mode);
+        metrics_phase(MP_RESOLVE);
 
         directory = directory_open(outpath, arguments->nameconversion, 0);
         if (directory == NULL) {
@@ -233,6 +234,7 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
             break;
         }
         directory_close(directory);
+        metrics_phase(MP_SCAN);
 
         if (!found) convertc64name(lname, name, type, arguments->nameconversion);
 
@@ -260,18 +262,20 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
 
             if (found && !overwrite) {
                 seterror(ER_FILE_EXISTS, 0);
+            } else if (partition_get_readonly(outpart) || (found && vfs_stream(lname, strlen(lname)))) {
+                seterror(ER_WRITE_PROTECT_ON, 0);
             } else {
-#ifndef WIN32
-                buffer->fd = open(outpath, O_CREAT | O_WRONLY | (overwrite ? O_TRUNC : O_EXCL), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-#else
-                buffer->fd = open(outpath, O_CREAT | O_WRONLY | (overwrite ? O_TRUNC : O_EXCL) | O_BINARY, S_IRUSR | S_IWUSR);
-#endif
-                if (buffer->fd < 0) {
+                if (found) {
+                    buffer->file = buffer_opentemp(buffer, outpath);
+                } else {
+                    buffer->file = vfs_fopenw(outpath, O_CREAT | O_WRONLY | (overwrite ? O_TRUNC : O_EXCL), &buffer->fd);
+                }
+                if (buffer->file == NULL) {
                     errtochannel15(1);
                 } else {
                     status = OPEN_WONLY;
-                    buffer->file = fdopen(buffer->fd, "wb");
                     buffer->mode = CM_COMPAT;
+                    buffer_writeinit(buffer, 0, arguments->prealloc, outpart);
                 }
             }
         } else {
@@ -280,23 +284,28 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
             } else {
                 switch (mode) {
                 case 'R':
-                    buffer->fd = open(outpath, O_RDONLY | O_BINARY, 0);
-                    if (buffer->fd < 0) {
+                    buffer->file = vfs_fopen(outpath, &buffer->fd);
+                    if (buffer->file == NULL) {
                         errtochannel15(1);
                     } else {
                         status = OPEN_RONLY;//ok
-                        buffer->file = fdopen(buffer->fd, "rb");
                         buffer->mode = CM_COMPAT;
+                        buffer_readinit(buffer, outpart);
                     }
                     break;
                 case 'A':
-                    buffer->fd = open(outpath, O_WRONLY | O_BINARY, 0);
-                    if (buffer->fd < 0) {
+                    if (partition_get_readonly(outpart) || vfs_stream(lname, strlen(lname))) {
+                        seterror(ER_WRITE_PROTECT_ON, 0);
+                        break;
+                    }
+                    buffer->file = vfs_fopenw(outpath, O_WRONLY, &buffer->fd);
+                    if (buffer->file == NULL) {
                         errtochannel15(1);
                     } else {
                         status = OPEN_WONLY;//ok
-                        buffer->file = fdopen(buffer->fd, "ab");
                         buffer->mode = CM_COMPAT;
+                        fseek(buffer->file, 0, SEEK_END);
+                        buffer_writeinit(buffer, ftell(buffer->file), arguments->prealloc, outpart);
                     }
                     break;
                 default:
@@ -306,11 +315,12 @@ int openfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
         }
     }
 vege:
+    metrics_phase(buffer->mode == CM_DIR ? MP_SCAN : MP_IO);
     if (arguments->verbose) {
         log_time("Open: Took", duration(&start));
     }
     driver->sendb(status);
-    if (arguments->mode == M_ETHERNET) driver->sendb(status);
+    if (arguments->protocol == M_ETHERNET) driver->sendb(status);
     return driver->flush() != 0;
 }
 
@@ -327,7 +337,7 @@ int readfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
     channel = driver->getb(1) & 0x0f;
     buffer = &buff[channel];
     r = driver->getb(0);
-    if (arguments->mode == M_ETHERNET) {
+    if (arguments->protocol == M_ETHERNET) {
         bytes = r != 0 ? r : 256;
         if (driver->done()) return 1;
         if (r == EOF) {
@@ -340,16 +350,17 @@ int readfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
         if (bytes == 0) bytes = 65536;
         if (check_trailer(driver, "Read", usecrc)) return 1;
     }
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) log_printf("Read #%d: %d bytes", channel, bytes);
-    if (arguments->mode != M_ETHERNET) driver->sendb(0);
+    if (arguments->protocol != M_ETHERNET) driver->sendb(0);
     if (buffer->mode != CM_DIR && buffer->mode != CM_ERR && (buffer->mode != CM_COMPAT || buffer->file == NULL)) {
         log_print((buffer->mode == CM_CLOSED) ? "Read: Channel not open" : "Read: Not readable");
     error:
         crc_clear(0);
         driver->sendb(0);
         driver->sendb(0);
-        if (arguments->mode != M_ETHERNET) {
+        if (arguments->protocol != M_ETHERNET) {
             if (usecrc) {
                 driver->sendb(crc_get());
             }
@@ -371,6 +382,7 @@ int readfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
             ungetc(c, buffer->file);
         }
         j = 0;
+        metrics_phase(MP_IO);
     } else {
         size_t length = buffer->size;
         if (buffer->mode == CM_ERR) {
@@ -385,11 +397,10 @@ int readfile_compat(const Driver *driver, Buffer *buff, const Arguments *argumen
         buffer->pointer += bytes;
     }
 
-    if (arguments->mode == M_ETHERNET) {
-        unsigned int i;
+    if (arguments->protocol == M_ETHERNET) {
         driver->sendb(bytes > 0);
         driver->sendb(bytes);
-        for (i = 0; i < bytes; i++) driver->sendb(buffer->data[bytes - i - 1 + j]);
+        driver->sendrbytes(buffer->data + j, bytes);
         if (bytes & 1) driver->sendb(status);
         driver->sendb(status);
         driver->sendb(status);
@@ -423,7 +434,7 @@ int closefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
     r = driver->getb(1);
     channel = r & 0x0f;
     buffer = &buff[channel];
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (check_trailer(driver, "Close", usecrc)) return 1;
     } else {
         if (driver->done()) return 1;
@@ -433,32 +444,30 @@ int closefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
             return 1;
         }
     }
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) {
         gettimeofday(&start, NULL);
     }
     if (arguments->verbose) log_printf("Close #%d", channel);
     if (buffer->mode == CM_COMPAT) {
-        if (buffer->file != NULL) {
-            fclose(buffer->file);
-            buffer->file = NULL;
+        if (buffer->file != NULL && buffer_close(buffer, arguments, 1)) {
+            log_printf("Close: Couldn't write: %s(%d)", strerror(errno), errno);
+            errtochannel15(1);
         }
         if (channel == 15) buffer->mode = CM_ERR;
         else {
             buffer->mode = CM_CLOSED;
-            if (buffer->data != NULL) {
-                buffer->capacity = 0;
-                free(buffer->data);
-                buffer->data = NULL;
-            }
+            buffer_release(buffer);
         }
     }
+    metrics_phase(MP_IO);
     if (arguments->verbose) {
         log_time("Close: Took", duration(&start));
     }
 
     driver->sendb(0);
-    if (arguments->mode == M_ETHERNET) driver->sendb(0);
+    if (arguments->protocol == M_ETHERNET) driver->sendb(0);
     return driver->flush() != 0;
 }
 
@@ -468,22 +477,24 @@ int writefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
     unsigned short int bytes;
     struct timeval start, end;
     Buffer *buffer;
+    int r;
 
     channel = driver->getb(1) & 0x0f;
     buffer = &buff[channel];
     bytes = driver->getb(0);
-    if (arguments->mode == M_ETHERNET) {
+    if (arguments->protocol == M_ETHERNET) {
         driver->getb(0);
     } else {
         bytes |= driver->getb(0) << 8;
         if (check_trailer(driver, "Write", usecrc)) return 1;
     }
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) log_printf("Write #%d: %d bytes", channel, bytes);
     if (buffer->mode == CM_ERR) {
         Petscii cmd[256];
 
-        if (arguments->mode == M_ETHERNET) {
+        if (arguments->protocol == M_ETHERNET) {
             driver->getbytes(cmd, bytes);
             if (driver->done()) return 1;
             driver->sendb(0);
@@ -499,8 +510,10 @@ int writefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
             driver->sendb(0);
         }
         if (driver->flush()) return 1;
+        metrics_phase(MP_RECEIVE);
         cmd[bytes - (bytes && cmd[bytes - 1] == 0x0d)] = 0;
         commandchannel(cmd);
+        metrics_phase(MP_IO);
         return 0;
     } else {
         if (buffer->mode != CM_COMPAT) {
@@ -508,7 +521,7 @@ int writefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
             log_print("Write: Not writeable");
         error:
             driver->sendb(2);
-            if (arguments->mode == M_ETHERNET) driver->sendb(2);
+            if (arguments->protocol == M_ETHERNET) driver->sendb(2);
             return driver->flush() != 0;
         }
 
@@ -517,10 +530,13 @@ int writefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
             goto error;
         }
 
-        if (arguments->mode == M_ETHERNET) {
+        if (arguments->protocol == M_ETHERNET) {
             driver->getbytes(buffer->data, bytes);
             if (driver->done()) return 1;
-            if (fwrite(buffer->data, 1, bytes, buffer->file) == bytes && fflush(buffer->file) == 0) {
+            metrics_phase(MP_RECEIVE);
+            r = buffer_write(buffer, buffer->woffset + buffer->wsize, buffer->data, bytes) == 0 && buffer_sync(buffer, arguments, 0) == 0;
+            metrics_phase(MP_IO);
+            if (r) {
                 driver->sendb(0);
                 driver->sendb(0);
             } else {
@@ -539,8 +555,11 @@ int writefile_compat(const Driver *driver, Buffer *buff, const Arguments *argume
             if (arguments->verbose) gettimeofday(&end, NULL);
 
             if (check_trailer(driver, "Write", usecrc)) return 1;
+            metrics_phase(MP_RECEIVE);
 
-            if (fwrite(buffer->data, 1, bytes, buffer->file) == bytes && fflush(buffer->file) == 0) {
+            r = buffer_write(buffer, buffer->woffset + buffer->wsize, buffer->data, bytes) == 0 && buffer_sync(buffer, arguments, 0) == 0;
+            metrics_phase(MP_IO);
+            if (r) {
                 driver->sendb(0);
             } else {
                 driver->sendb(2);
@@ -0,0 +1,423 @@
+/*
+
+ compress.c - Transparent reading of .gz and .zst compressed files
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef VFS
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_SPAN (1UL << 20)
+#define COMPRESS_BLOCK 65536
+#define COMPRESS_CURSORS 4
+#define WINDOW 32768
+
+typedef struct Point {
+    unsigned long long in, length, out;
+    unsigned long first;
+    int bits;
+    unsigned char *window;
+} Point;
+
+typedef struct Compressed {
+    Point *points;
+    unsigned long count, capacity;
+    unsigned long long total;
+    int zstd;
+} Compressed;
+
+static int probe(const char *name, size_t len) {
+    int l = vfs_extension(name, len, "gz");
+#ifdef HAVE_ZSTD
+    if (l == 0) l = vfs_extension(name, len, "zst");
+#endif
+    return l;
+}
+
+static Point *point_add(Compressed *z, unsigned long long in, unsigned long long out) {
+    Point *p;
+    if (z->count == z->capacity) {
+        unsigned long capacity = z->capacity ? z->capacity * 2 : 64;
+        p = (Point *)realloc(z->points, capacity * sizeof *p);
+        if (p == NULL) return NULL;
+        z->points = p;
+        z->capacity = capacity;
+    }
+    p = z->points + z->count++;
+    p->in = in;
+    p->length = 0;
+    p->out = out;
+    p->first = 0;
+    p->bits = 0;
+    p->window = NULL;
+    return p;
+}
+
+static void feed(z_stream *zs, const Vfs_container *c) {
+    size_t at = zs->next_in - c->data;
+    size_t left = c->datalen - at;
+    zs->avail_in = left > 0x40000000 ? 0x40000000 : left;
+}
+
+static int member(const Vfs_container *c, size_t at) {
+    return c->datalen - at >= 18 && c->data[at] == 0x1f && c->data[at + 1] == 0x8b;
+}
+
+static int gz_index(Vfs_container *c, Compressed *z, unsigned long long *size) {
+    z_stream zs;
+    unsigned char *window;
+    unsigned long long total = 0, last = 0;
+    int ret;
+
+    window = (unsigned char *)malloc(WINDOW);
+    memset(&zs, 0, sizeof zs);
+    if (window == NULL || inflateInit2(&zs, 15 + 32) != Z_OK) {
+        free(window);
+        return -1;
+    }
+    ret = (point_add(z, 0, 0) == NULL) ? Z_MEM_ERROR : Z_OK;
+    zs.next_in = c->data;
+    zs.avail_out = 0;
+    while (ret == Z_OK) {
+        unsigned int before;
+        if (zs.avail_in == 0) feed(&zs, c);
+        if (zs.avail_out == 0) {
+            zs.next_out = window;
+            zs.avail_out = WINDOW;
+        }
+        before = zs.avail_out;
+        ret = inflate(&zs, Z_BLOCK);
+        total += before - zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            if (!member(c, zs.next_in - c->data)) break;
+            ret = inflateReset(&zs);
+            continue;
+        }
+        if (ret == Z_BUF_ERROR && zs.avail_in == 0) break;
+        if (ret != Z_OK) break;
+        if ((zs.data_type & 128) && !(zs.data_type & 64) && total - last >= COMPRESS_SPAN) {
+            unsigned int have = WINDOW - zs.avail_out;
+            Point *p = point_add(z, zs.next_in - c->data, total);
+            if (p == NULL || (p->window = (unsigned char *)malloc(WINDOW)) == NULL) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            p->bits = zs.data_type & 7;
+            memcpy(p->window, window + have, WINDOW - have);
+            memcpy(p->window + WINDOW - have, window, have);
+            last = total;
+        }
+    }
+    inflateEnd(&zs);
+    free(window);
+    if (ret != Z_STREAM_END) return -1;
+    *size = total;
+    return 0;
+}
+
+static int gz_span(const Vfs_container *c, const Point *p, unsigned char *out, size_t len) {
+    z_stream zs;
+    int ret, raw = (p->window != NULL);
+
+    memset(&zs, 0, sizeof zs);
+    if (inflateInit2(&zs, raw ? -15 : 15 + 32) != Z_OK) return -1;
+    if (raw) {
+        if (p->bits) inflatePrime(&zs, p->bits, c->data[p->in - 1] >> (8 - p->bits));
+        inflateSetDictionary(&zs, p->window, WINDOW);
+    }
+    zs.next_in = c->data + p->in;
+    zs.avail_in = 0;
+    zs.next_out = out;
+    zs.avail_out = len;
+    ret = Z_OK;
+    while (zs.avail_out != 0 && ret == Z_OK) {
+        if (zs.avail_in == 0) feed(&zs, c);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            size_t at = zs.next_in - c->data;
+            if (raw) at += 8;
+            if (at > c->datalen || !member(c, at)) break;
+            zs.next_in = c->data + at;
+            zs.avail_in = 0;
+            raw = 0;
+            ret = inflateReset2(&zs, 15 + 32);
+        }
+    }
+    inflateEnd(&zs);
+    return zs.avail_out == 0 ? 0 : -1;
+}
+
+#ifdef HAVE_ZSTD
+static unsigned long le(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static ZSTD_DCtx *dctx;
+
+typedef struct Cursor {
+    const Vfs_container *container;
+    unsigned long point, index, used;
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    int active;
+} Cursor;
+
+static Cursor cursors[COMPRESS_CURSORS];
+static unsigned long tick;
+
+static int zst_load(Vfs_container *c, Compressed *z, unsigned long long *size) {
+    size_t at = 0;
+    unsigned long long out = 0;
+    unsigned long first = 0;
+    while (at < c->datalen) {
+        const unsigned char *d = c->data + at;
+        size_t clen = ZSTD_findFrameCompressedSize(d, c->datalen - at);
+        unsigned long long ulen;
+        Point *p;
+
+        if (ZSTD_isError(clen)) return -1;
+        if ((le(d) & 0xfffffff0) == 0x184d2a50) {
+            at += clen;
+            continue;
+        }
+        ulen = ZSTD_getFrameContentSize(d, clen);
+        if (ulen == ZSTD_CONTENTSIZE_ERROR) return -1;
+        if (ulen == ZSTD_CONTENTSIZE_UNKNOWN) {
+            static unsigned char scratch[65536];
+            ZSTD_inBuffer in = {d, clen, 0};
+            size_t ret;
+            if (dctx == NULL && (dctx = ZSTD_createDCtx()) == NULL) return -1;
+            ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+            ulen = 0;
+            do {
+                ZSTD_outBuffer o = {scratch, sizeof scratch, 0};
+                size_t before = in.pos;
+                ret = ZSTD_decompressStream(dctx, &o, &in);
+                if (ZSTD_isError(ret) || (o.pos == 0 && in.pos == before)) return -1;
+                ulen += o.pos;
+            } while (ret != 0);
+        }
+        if (ulen != 0) {
+            p = point_add(z, at, out);
+            if (p == NULL) return -1;
+            p->length = clen;
+            p->first = first;
+            first += (ulen + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+            out += ulen;
+        }
+        at += clen;
+    }
+    *size = out;
+    return 0;
+}
+
+static Cursor *cursor_get(const Vfs_container *c, unsigned long point, unsigned long index) {
+    unsigned int i, slot = 0;
+    Cursor *cursor;
+    for (i = 0; i < COMPRESS_CURSORS; i++) {
+        cursor = cursors + i;
+        if (cursor->active && cursor->container == c && cursor->point == point && cursor->index <= index) return cursor;
+        if (!cursor->active) {
+            if (cursors[slot].active) slot = i;
+        } else if (cursors[slot].active && cursor->used < cursors[slot].used) slot = i;
+    }
+    cursor = cursors + slot;
+    cursor->active = 0;
+    if (cursor->dctx == NULL && (cursor->dctx = ZSTD_createDCtx()) == NULL) return NULL;
+    ZSTD_DCtx_reset(cursor->dctx, ZSTD_reset_session_only);
+    cursor->active = 1;
+    cursor->container = c;
+    cursor->point = point;
+    cursor->index = 0;
+    cursor->in.src = c->data + ((const Compressed *)c->priv)->points[point].in;
+    cursor->in.size = ((const Compressed *)c->priv)->points[point].length;
+    cursor->in.pos = 0;
+    return cursor;
+}
+
+static const Vfs_block *zst_block(const Vfs_container *c, const Vfs_entry *e, unsigned long k, unsigned long index) {
+    static unsigned char scratch[COMPRESS_BLOCK];
+    const Compressed *z = (const Compressed *)c->priv;
+    const Point *p = z->points + k;
+    int entry = e - c->entries;
+    unsigned long long end = (k + 1 < z->count) ? p[1].out : z->total;
+    Cursor *cursor;
+    Vfs_block *b = vfs_block(c, entry, p->first + index);
+
+    if (b != NULL) return b;
+    cursor = cursor_get(c, k, index);
+    if (cursor == NULL) return NULL;
+    cursor->used = ++tick;
+    for (;;) {
+        unsigned long long at = p->out + (unsigned long long)cursor->index * COMPRESS_BLOCK;
+        size_t len = (end - at > COMPRESS_BLOCK) ? COMPRESS_BLOCK : end - at;
+        ZSTD_outBuffer out;
+        size_t ret;
+        int fresh = 0;
+
+        b = vfs_block(c, entry, p->first + cursor->index);
+        if (b == NULL) {
+            b = vfs_block_new(c, entry, p->first + cursor->index, len);
+            if (b == NULL) return NULL;
+            fresh = 1;
+        }
+        out.dst = fresh ? b->data : scratch;
+        out.size = len;
+        out.pos = 0;
+        while (out.pos < len) {
+            size_t before = cursor->in.pos;
+            ret = ZSTD_decompressStream(cursor->dctx, &out, &cursor->in);
+            if (ZSTD_isError(ret) || (ret == 0 && out.pos < len) || (out.pos == 0 && cursor->in.pos == before)) break;
+        }
+        if (out.pos < len) {
+            cursor->active = 0;
+            if (fresh) vfs_block_free(b);
+            return NULL;
+        }
+        if (fresh) vfs_block_share(b);
+        if (cursor->index++ == index) return b;
+    }
+}
+#endif
+
+static int load(Vfs_container *c) {
+    const char *name = strrchr(c->path, '/');
+    size_t len;
+    unsigned long long size;
+    Compressed *z = (Compressed *)calloc(1, sizeof *z);
+    int e;
+
+    if (z == NULL) return -1;
+    c->priv = z;
+    name = (name != NULL) ? name + 1 : c->path;
+    len = strlen(name);
+    len -= probe(name, len);
+    if (member(c, 0)) {
+        if (gz_index(c, z, &size)) return -1;
+#ifdef HAVE_ZSTD
+    } else if (c->datalen >= 4 && le(c->data) == 0xfd2fb528) {
+        z->zstd = 1;
+        if (zst_load(c, z, &size)) return -1;
+#endif
+    } else return -1;
+    z->total = size;
+    if (size > 0xffffffffUL) size = 0xffffffffUL;
+    e = vfs_add(c, name, len, 0, size, c->mtime);
+    return (e < 0) ? -1 : 0;
+}
+
+static size_t read_data(Vfs_container *c, const Vfs_entry *e, unsigned long pos, unsigned char *buf, size_t len) {
+    Compressed *z = (Compressed *)c->priv;
+    int entry = e - c->entries;
+    size_t done = 0;
+
+    while (done < len) {
+        unsigned long lo = 0, hi = z->count, k, in, l;
+        const Vfs_block *b;
+        while (hi - lo > 1) {
+            unsigned long mid = (lo + hi) / 2;
+            if (z->points[mid].out <= pos) lo = mid; else hi = mid;
+        }
+        k = lo;
+        if (k >= z->count || z->points[k].out > pos) break;
+#ifdef HAVE_ZSTD
+        if (z->zstd) {
+            in = pos - z->points[k].out;
+            b = zst_block(c, e, k, in / COMPRESS_BLOCK);
+            if (b == NULL) break;
+            in %= COMPRESS_BLOCK;
+        } else
+#endif
+        {
+            b = vfs_block(c, entry, k);
+            if (b == NULL) {
+                const Point *p = z->points + k;
+                size_t span = ((k + 1 < z->count) ? p[1].out : z->total) - p->out;
+                Vfs_block *n = vfs_block_new(c, entry, k, span);
+                if (n == NULL) break;
+                if (gz_span(c, p, n->data, span)) {
+                    vfs_block_free(n);
+                    break;
+                }
+                vfs_block_share(n);
+                b = n;
+            }
+            in = pos - z->points[k].out;
+        }
+        if (in >= b->length) break;
+        l = b->length - in;
+        if (l > len - done) l = len - done;
+        memcpy(buf + done, b->data + in, l);
+        done += l;
+        pos += l;
+    }
+    return done;
+}
+
+static void release(Vfs_container *c) {
+    Compressed *z = (Compressed *)c->priv;
+    unsigned long i;
+    if (z == NULL) return;
+#ifdef HAVE_ZSTD
+    for (i = 0; i < COMPRESS_CURSORS; i++) {
+        if (cursors[i].container == c) cursors[i].active = 0;
+    }
+#endif
+    for (i = 0; i < z->count; i++) free(z->points[i].window);
+    free(z->points);
+    free(z);
+}
+#else
+static int probe(const char *name, size_t len) {
+    (void)name; (void)len;
+    return 0;
+}
+
+static int load(Vfs_container *c) {
+    (void)c;
+    return -1;
+}
+
+static size_t read_data(Vfs_container *c, const Vfs_entry *e, unsigned long pos, unsigned char *buf, size_t len) {
+    (void)c; (void)e; (void)pos; (void)buf; (void)len;
+    return 0;
+}
+
+static void release(Vfs_container *c) {
+    (void)c;
+}
+#endif
+
+static const Vfs_backend backend = {
+    probe,
+    load,
+    read_data,
+    release,
+    1
+};
+
+const Vfs_backend *compress_backend(void) {
+    return &backend;
+}
@@ -32,6 +32,7 @@ typedef struct Driver {
     void (*sendb)(unsigned char);
     void (*getbytes)(unsigned char [], unsigned int);
     void (*sendbytes)(const unsigned char [], unsigned int);
+    void (*sendrbytes)(const unsigned char [], unsigned int);
     void (*shutdown)(void);
     int  (*flush)(void);
     int  (*done)(void);
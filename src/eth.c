@@ -22,6 +22,9 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include "eth.h"
 #include <unistd.h>
 #include <stdio.h>
@@ -39,6 +42,7 @@
 #include "crc8.h"
 #include "log.h"
 #include "driver.h"
+#include "memrev.h"
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
@@ -47,13 +51,41 @@
 #define CLIENT_IP "127.0.0.1"
 #define SERVER_IP INADDR_ANY
 #define SERVER_PORT 64000
+#define PACKET_SIZE 1030
+#define BATCH_SIZE 32
+#define CACHE_SIZE 8
+#define WINDOW_SIZE 64
+#define WINDOWS 4
+
+typedef struct Packet {
+    unsigned char data[PACKET_SIZE];
+    unsigned int len;
+    struct sockaddr_in addr;
+} Packet;
+
+typedef struct Reply {
+    struct in_addr client;
+    unsigned int hash, stamp;
+    int replies, sequenced;
+    Packet request, reply;
+} Reply;
+
+typedef struct Window {
+    unsigned int stamp, len;
+    Packet request, packets[WINDOW_SIZE];
+} Window;
 
 static int sock = -1;
-static unsigned char ebufi[1030], ebufo[1030];
+static Packet ipool[BATCH_SIZE], opool[BATCH_SIZE];
+static unsigned int ipoolp, ipooll, opooll;
+static unsigned char *ebufi = ipool[0].data, *ebufo = opool[0].data;
 static unsigned int ebufip, ebufop, ebufil;
+static Reply cache[CACHE_SIZE], *current;
+static unsigned int cache_stamp;
+static Window windows[WINDOWS], *recording;
+static unsigned int window_stamp;
 static struct sockaddr_in eserver;
 static struct sockaddr_in eclient;
-static socklen_t fromlen = sizeof(struct sockaddr_in);
 static struct in_addr sin_addr;
 static struct hostent *hp;
 static const char *i_addr;
@@ -134,13 +166,13 @@ static int initialize(int lastfail) {
 static int getb(int use_timeout) {
     (void)use_timeout;
     if (driver_errno != 0) return EOF;
-    if (ebufip >= sizeof ebufi) return EOF;
+    if (ebufip >= PACKET_SIZE) return EOF;
     if (ebufip >= ebufil) return EOF;
     return ebufi[ebufip++];
 }
 
 static void sendb(unsigned char a) {
-    if (ebufop >= sizeof ebufo) {
+    if (ebufop >= PACKET_SIZE) {
         if (driver_errno != 0) return;
         driver_errno = -EIO;
         return;
@@ -161,9 +193,9 @@ static void getbytes(unsigned char data[], unsigned int bytes) {
 }
 
 static void sendbytes(const unsigned char data[], unsigned int bytes) {
-    if (ebufop + bytes > sizeof ebufo) {
-        memcpy(ebufo + ebufop, data, sizeof(ebufo) - ebufop);
-        ebufop = sizeof ebufo;
+    if (ebufop + bytes > PACKET_SIZE) {
+        memcpy(ebufo + ebufop, data, PACKET_SIZE - ebufop);
+        ebufop = PACKET_SIZE;
         if (driver_errno != 0) return;
         driver_errno = -EIO;
         return;
@@ -172,10 +204,100 @@ static void sendbytes(const unsigned char data[], unsigned int bytes) {
     ebufop += bytes;
 }
 
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    if (ebufop + bytes > PACKET_SIZE) {
+        memrevcpy(ebufo + ebufop, data + bytes - (PACKET_SIZE - ebufop), PACKET_SIZE - ebufop);
+        ebufop = PACKET_SIZE;
+        if (driver_errno != 0) return;
+        driver_errno = -EIO;
+        return;
+    }
+    memrevcpy(ebufo + ebufop, data, bytes);
+    ebufop += bytes;
+}
+
+static int receive(void) {
+    int n;
+#ifdef __linux__
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    for (n = 0; n < BATCH_SIZE; n++) {
+        iov[n].iov_base = ipool[n].data + 2;
+        iov[n].iov_len = PACKET_SIZE - 2;
+        memset(&msgs[n].msg_hdr, 0, sizeof msgs[n].msg_hdr);
+        msgs[n].msg_hdr.msg_name = &ipool[n].addr;
+        msgs[n].msg_hdr.msg_namelen = sizeof ipool[n].addr;
+        msgs[n].msg_hdr.msg_iov = &iov[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(sock, msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+    if (n < 0) return -EIO;
+    ipooll = n;
+    while (n--) ipool[n].len = msgs[n].msg_len;
+#else
+    socklen_t fromlen = sizeof ipool[0].addr;
+    n = recvfrom(sock, (char *)ipool[0].data + 2, PACKET_SIZE - 2, MSG_NOSIGNAL, (struct sockaddr *)&ipool[0].addr, &fromlen);
+    if (n < 0) return -EIO;
+    ipool[0].len = n;
+    ipooll = 1;
+#endif
+    ipoolp = 0;
+    return 0;
+}
+
+static int transmit(void) {
+    unsigned int i;
+    int err = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    for (i = 0; i < opooll; i++) {
+        iov[i].iov_base = opool[i].data;
+        iov[i].iov_len = opool[i].len;
+        memset(&msgs[i].msg_hdr, 0, sizeof msgs[i].msg_hdr);
+        msgs[i].msg_hdr.msg_name = &opool[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof opool[i].addr;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    i = 0;
+    while (i < opooll) {
+        int n = sendmmsg(sock, msgs + i, opooll - i, MSG_NOSIGNAL);
+        if (n <= 0) {
+            err = -EIO;
+            break;
+        }
+        i += n;
+    }
+#else
+    for (i = 0; i < opooll; i++) {
+        if (sendto(sock, (char *)opool[i].data, opool[i].len, MSG_NOSIGNAL, (struct sockaddr *)&opool[i].addr, sizeof opool[i].addr) < 0) err = -EIO;
+    }
+#endif
+    opooll = 0;
+    ebufo = opool[0].data;
+    if (err) {
+#ifdef __MINGW32__
+        int wsaerrno = WSAGetLastError();
+        log_printf("Cannot send to C64: %S(%d)", wsaerror(wsaerrno), wsaerrno);
+#else
+        log_printf("Cannot send to C64: %s(%d)", strerror(errno), errno);
+#endif
+        driver_errno = err;
+    }
+    return err;
+}
+
 static void eshutdown(void) {
     if (sock >= 0) close(sock);
     sock = -1;
     inited = 0;
+    ipoolp = ipooll = opooll = 0;
+    ebufo = opool[0].data;
+    memset(cache, 0, sizeof cache);
+    current = NULL;
+    memset(windows, 0, sizeof windows);
+    recording = NULL;
 
 #ifdef __MINGW32__
     if (wsainited == 1) {
@@ -188,11 +310,22 @@ static void eshutdown(void) {
 
 static int flush(void) {
     if (ebufop != 0 && driver_errno == 0) {
-        if (sendto(sock, (char *)ebufo, ebufop, MSG_NOSIGNAL, (struct sockaddr *)&eclient, fromlen) < 0) {
-            ebufop = 0;
-            return -EIO;
-        }
+        Packet *packet = &opool[opooll++];
+        packet->len = ebufop;
+        packet->addr = eclient;
         ebufop = 0;
+        if (recording != NULL && recording->len < WINDOW_SIZE) {
+            recording->packets[recording->len++] = *packet;
+        }
+        if (current != NULL && current->sequenced && current->replies++ == 0) {
+            current->reply.len = packet->len;
+            memcpy(current->reply.data, packet->data, packet->len);
+        }
+        if (opooll >= BATCH_SIZE || ipoolp >= ipooll) {
+            if (transmit()) return -EIO;
+        } else {
+            ebufo = opool[opooll].data;
+        }
     }
     return driver_errno;
 }
@@ -205,25 +338,151 @@ static void turn(void) {
 }
 
 static int clean(void) {
+    if (recording != NULL) {
+        recording->request.len = recording->len = recording->stamp = 0;
+        recording = NULL;
+    }
+    if (current != NULL) {
+        current->replies = 0;
+        current->request.len = 0;
+        current = NULL;
+    }
     ebufip = 0;
     ebufil = 0;
     ebufop = 0;
     return 0;
 }
 
+static int cacheable(unsigned char command) {
+    switch (command) {
+    case 'N': case 0xCE:
+    case 'G': case 0xC7:
+    case 'P': case 'S': case 0xD3:
+    case 'D': case 0xC4:
+    case 'I': case 0xC9:
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned int hash(const unsigned char data[], unsigned int len) {
+    unsigned int h = 2166136261u;
+    while (len--) h = (h ^ *data++) * 16777619u;
+    return h;
+}
+
+static int queue(const Packet *packet) {
+    Packet *out = &opool[opooll++];
+    out->len = packet->len;
+    out->addr = eclient;
+    memcpy(out->data, packet->data, out->len);
+    if (opooll >= BATCH_SIZE) return transmit();
+    ebufo = opool[opooll].data;
+    return 0;
+}
+
+static Window *window(const Packet *packet, Window **oldest) {
+    unsigned int i;
+    for (i = 0; i < WINDOWS; i++) {
+        Window *w = &windows[i];
+        if (w->request.len != 0 && w->request.addr.sin_addr.s_addr == packet->addr.sin_addr.s_addr) return w;
+        if (oldest != NULL && w->stamp < (*oldest)->stamp) *oldest = w;
+    }
+    return NULL;
+}
+
+static int burst(const Packet *packet) {
+    unsigned int i, args = packet->data[0] ? 1 : 3;
+    unsigned char command = packet->data[args - 1];
+    const unsigned char *bitmap;
+    Window *w, *oldest = windows;
+
+    if (command != 'G' && command != 0xC7) return 0;
+    if (packet->len + 2 < args + 6 || packet->data[args + 5] != 'B') return 0;
+
+    w = window(packet, &oldest);
+    if (w != NULL && w->len != 0 && !memcmp(w->request.data, packet->data, args + 5)) {
+        bitmap = (packet->len + 2 >= args + 6 + WINDOW_SIZE / 8) ? packet->data + args + 6 : NULL;
+        for (i = 0; i < w->len; i++) {
+            if (bitmap != NULL && !(bitmap[i >> 3] & (1 << (i & 7)))) continue;
+            if (queue(&w->packets[i])) break;
+        }
+        w->stamp = ++window_stamp;
+        return 1;
+    }
+    if (w == NULL) w = oldest;
+    w->request.addr = packet->addr;
+    w->request.len = packet->len;
+    memcpy(w->request.data, packet->data, args + 5);
+    w->len = 0;
+    w->stamp = ++window_stamp;
+    recording = w;
+    return -1;
+}
+
+static int replay(const Packet *packet) {
+    Reply *reply, *oldest = cache;
+    unsigned int i, h;
+    int b, sequenced;
+    Window *w;
+
+    current = NULL;
+    recording = NULL;
+    b = burst(packet);
+    if (b != 0) return b > 0;
+    w = window(packet, NULL);
+    if (w != NULL) w->request.len = w->len = w->stamp = 0;
+    if (packet->data[0] != 0 || !cacheable(packet->data[2])) return 0;
+    h = hash(packet->data, packet->len + 2);
+    sequenced = 0;
+    for (i = 0; i < CACHE_SIZE; i++) {
+        reply = &cache[i];
+        if (reply->stamp < oldest->stamp) oldest = reply;
+        if (reply->stamp == 0 || reply->client.s_addr != packet->addr.sin_addr.s_addr) continue;
+        if (reply->replies == 1 && reply->hash == h && reply->request.len == packet->len
+            && !memcmp(reply->request.data, packet->data, packet->len + 2)) {
+            queue(&reply->reply);
+            reply->stamp = ++cache_stamp;
+            return 1;
+        }
+        sequenced = reply->request.len != 0 && reply->request.data[1] != packet->data[1];
+        oldest = reply;
+        break;
+    }
+    reply = oldest;
+    reply->client = packet->addr.sin_addr;
+    reply->hash = h;
+    reply->stamp = ++cache_stamp;
+    reply->replies = 0;
+    reply->sequenced = sequenced;
+    reply->request.len = packet->len;
+    memcpy(reply->request.data, packet->data, packet->len + 2);
+    current = reply;
+    return 0;
+}
+
 static int waitb(unsigned char ec) {
-    int n;
+    Packet *packet;
     (void)ec;
     if (sock < 0 || !inited) return -ENODEV;
     ebufip = ebufil = 0;
-    n = recvfrom(sock, (char *)ebufi + 2, sizeof(ebufi) - 2, MSG_NOSIGNAL, (struct sockaddr *)&eclient, &fromlen);
-    if (n < 0) return -EIO;
-    ebufi[0] = ntohs(eclient.sin_port) >> 8;
-    ebufi[1] = ntohs(eclient.sin_port);
-    eclient.sin_addr.s_addr = sin_addr.s_addr;
     driver_errno = 0;
+    for (;;) {
+        if (driver_errno != 0) return driver_errno;
+        if (ipoolp >= ipooll) {
+            if (opooll != 0 && transmit()) return -EIO;
+            if (receive()) return -EIO;
+        }
+        packet = &ipool[ipoolp++];
+        packet->data[0] = ntohs(packet->addr.sin_port) >> 8;
+        packet->data[1] = ntohs(packet->addr.sin_port);
+        eclient = packet->addr;
+        eclient.sin_addr.s_addr = sin_addr.s_addr;
+        if (!replay(packet)) break;
+    }
+    ebufi = packet->data;
     ebufip = ebufi[0] ? 0 : 2;
-    ebufil = n + 2;
+    ebufil = packet->len + 2;
     return ebufi[ebufip++];
 }
 
@@ -234,6 +493,7 @@ static const Driver driver = {
     .sendb        = sendb,
     .getbytes     = getbytes,
     .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
     .shutdown     = eshutdown,
     .flush        = flush,
     .done         = done,
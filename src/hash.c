@@ -0,0 +1,228 @@
+/*
+
+ hash.c - CRC-32C checksums of files with a small result cache
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stddef.h>
+#include "hash.h"
+#include "metrics.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#if !defined WIN32 && !defined __DJGPP__
+#include <sys/mman.h>
+#include "log.h"
+#define HASH_SHARED
+#endif
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__) && !defined __DJGPP__
+#include <nmmintrin.h>
+#define HASH_SSE42
+#endif
+
+#define HASH_CACHE 256
+
+typedef struct Hashcache {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long nsec;
+    unsigned long crc;
+    int valid;
+    unsigned int seq;
+} Hashcache;
+
+#ifdef HASH_SHARED
+#define seq_load(a) __atomic_load_n(&(a), __ATOMIC_ACQUIRE)
+#define seq_check(a, b) (__atomic_thread_fence(__ATOMIC_ACQUIRE), __atomic_load_n(&(a), __ATOMIC_RELAXED) == (b))
+#define seq_claim(a, b) __atomic_compare_exchange_n(&(a), &(b), (b) + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#define seq_release(a, b) __atomic_store_n(&(a), (b) + 2, __ATOMIC_RELEASE)
+#else
+#define seq_load(a) (a)
+#define seq_check(a, b) 1
+#define seq_claim(a, b) 1
+#define seq_release(a, b) ((void)(b))
+#endif
+
+static unsigned int crc32c_table[8][256];
+static Hashcache hashcache_private[HASH_CACHE], *hashcache = hashcache_private;
+
+static void crc32c_init(void) {
+    unsigned int i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) c = (c >> 1) ^ ((c & 1) ? 0x82f63b78 : 0);
+        crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        c = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+            crc32c_table[j][i] = c;
+        }
+    }
+}
+
+static unsigned int crc32c_soft(unsigned int crc, const unsigned char *data, size_t len) {
+    if (crc32c_table[0][1] == 0) crc32c_init();
+    while (len >= 8) {
+        unsigned int a = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24));
+        crc = crc32c_table[7][a & 0xff] ^ crc32c_table[6][(a >> 8) & 0xff] ^
+            crc32c_table[5][(a >> 16) & 0xff] ^ crc32c_table[4][a >> 24] ^
+            crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]] ^
+            crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+        data += 8; len -= 8;
+    }
+    while (len--) crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef HASH_SSE42
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *data, size_t len) {
+    while (len != 0 && ((size_t)data & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++); len--;
+    }
+#ifdef __x86_64__
+    for (; len >= 8; data += 8, len -= 8) {
+        unsigned long long v;
+        memcpy(&v, data, sizeof v);
+        crc = (unsigned int)_mm_crc32_u64(crc, v);
+    }
+#else
+    for (; len >= 4; data += 4, len -= 4) {
+        unsigned int v;
+        memcpy(&v, data, sizeof v);
+        crc = _mm_crc32_u32(crc, v);
+    }
+#endif
+    while (len--) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+unsigned long hash_crc32c(unsigned long crc, const unsigned char *data, size_t len) {
+#ifdef HASH_SSE42
+    static int sse42 = -1;
+    if (sse42 < 0) {
+        __builtin_cpu_init();
+        sse42 = __builtin_cpu_supports("sse4.2");
+    }
+    if (sse42) return ~crc32c_sse42(~(unsigned int)crc, data, len) & 0xffffffff;
+#endif
+    return ~crc32c_soft(~(unsigned int)crc, data, len) & 0xffffffff;
+}
+
+int hash_share(void) {
+#ifdef HASH_SHARED
+    Hashcache *shared = (Hashcache *)mmap(NULL, sizeof hashcache_private, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        log_printf("Couldn't map the shared hash cache: %s(%d)", strerror(errno), errno);
+        return -1;
+    }
+    hashcache = shared;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int hash_fd(int fd, unsigned long *crc, int cache) {
+    static unsigned char data[65536];
+    struct stat buf;
+    Hashcache *entry = NULL;
+    unsigned long c = 0;
+    off_t offset = 0;
+    long nsec = 0;
+    unsigned int seq = 0;
+#ifdef __DJGPP__
+    off_t pos;
+#endif
+
+    if (cache) {
+        if (fstat(fd, &buf)) return -1;
+#ifdef __linux__
+        nsec = buf.st_mtim.tv_nsec;
+#endif
+        entry = &hashcache[(buf.st_ino ^ buf.st_dev) % HASH_CACHE];
+        seq = seq_load(entry->seq);
+        if (!(seq & 1) && entry->valid && entry->dev == buf.st_dev && entry->ino == buf.st_ino &&
+            entry->size == buf.st_size && entry->mtime == buf.st_mtime && entry->nsec == nsec) {
+            unsigned long cached = entry->crc;
+            if (seq_check(entry->seq, seq)) {
+                *crc = cached;
+                metrics_cache(1);
+                return 0;
+            }
+        }
+        metrics_cache(0);
+    }
+
+#ifdef __DJGPP__
+    pos = lseek(fd, 0, SEEK_CUR);
+#endif
+    for (;;) {
+#ifdef __DJGPP__
+        ssize_t l = (lseek(fd, offset, SEEK_SET) < 0) ? -1 : read(fd, data, sizeof data);
+#else
+        ssize_t l = pread(fd, data, sizeof data, offset);
+#endif
+        if (l == 0) break;
+        if (l < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        c = hash_crc32c(c, data, l);
+        offset += l;
+    }
+#ifdef __DJGPP__
+    lseek(fd, pos, SEEK_SET);
+#endif
+
+    if (entry != NULL) seq = seq_load(entry->seq);
+    if (entry != NULL && !(seq & 1) && seq_claim(entry->seq, seq)) {
+        entry->dev = buf.st_dev;
+        entry->ino = buf.st_ino;
+        entry->size = buf.st_size;
+        entry->mtime = buf.st_mtime;
+        entry->nsec = nsec;
+        entry->crc = c;
+        entry->valid = (offset == buf.st_size);
+        seq_release(entry->seq, seq);
+    }
+    *crc = c;
+    return 0;
+}
+
+int hash_file(FILE *file, unsigned long *crc) {
+    static unsigned char data[65536];
+    unsigned long c = 0;
+    size_t l;
+    long pos = ftell(file);
+
+    if (pos < 0 || fseek(file, 0, SEEK_SET)) return -1;
+    while ((l = fread(data, 1, sizeof data, file)) != 0) {
+        c = hash_crc32c(c, data, l);
+    }
+    if (ferror(file) || fseek(file, pos, SEEK_SET)) return -1;
+    *crc = c;
+    return 0;
+}
@@ -27,12 +27,18 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include "ideservd.h"
 #include <errno.h>
 #ifndef WIN32           //*NIX
 #include <pwd.h>
 #include <grp.h>
 #include <sys/wait.h>
+#ifndef __DJGPP__
+#include <poll.h>
+#endif
 #else                   //WIN32
 #include <windows.h>
 #include "resource.h"
@@ -44,6 +50,7 @@
 #endif
 #include <string.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <locale.h>
 #include "path.h"
@@ -55,6 +62,9 @@
 #include "eth.h"
 #include "vice.h"
 #endif
+#if !defined WIN32 && !defined __DJGPP__
+#include "shm.h"
+#endif
 #include "rs232.h"
 #ifndef OSX
 #include "x1541.h"
@@ -67,9 +77,13 @@
 #include "log.h"
 #include "message.h"
 #include "buffer.h"
-#ifdef __MINGW32__
-#define mkdir(a, b) mkdir (a)
-#endif
+#include "hash.h"
+#include "metrics.h"
+#include "trace.h"
+#include "vfs.h"
+#include "ram.h"
+
+#define COPY_SOURCES 8
 
 static const Driver *driver;
 
@@ -83,6 +97,8 @@ static long WINAPI PCLinkLoop(long);
 #ifndef  __DJGPP__
 #define FORKING
 static int pipefd = -1;
+static int metricsfd = -1;
+static volatile sig_atomic_t dumprequest;
 #endif
 #endif
 
@@ -92,8 +108,8 @@ static void terminate(int x) {
     if (driver != NULL) driver->shutdown();
     for (b = 0; b < 16; b++) {
         Buffer *buffer = &buff[b];
-        if (buffer->file != NULL) fclose(buffer->file);
-        if (buffer->data != NULL) free(buffer->data);
+        if (buffer->file != NULL) buffer_close(buffer, &arguments, 0);
+        buffer_release(buffer);
     }
     for (b = 0; b < 256; b++) partition_set_path(b, NULL);
 #ifdef FORKING
@@ -103,9 +119,30 @@ static void terminate(int x) {
     exit(0);
 }
 
+#ifndef WIN32
+static int reconnect(void) {
+    unsigned int delay = 1000;
+    int fail = 0;
+    if (arguments.mode == M_VICELISTEN || arguments.mode == M_USBLISTEN || arguments.mode == M_REPLAY || arguments.mode == M_REPLAYRT) return -1;
+    driver->shutdown();
+    for (;;) {
+        usleep(delay);
+        fail = driver->initialize(fail);
+        if (!fail) break;
+        if (delay >= 1000000) return fail;
+        delay *= 2;
+    }
+    driver->clean();
+    log_printf("Reconnected after %u ms", (delay * 2 - 1000) / 1000);
+    return 0;
+}
+#endif
+
 void seterror(Errorcode c, int i1) {
     const char *msg;
 
+    if (c == ER_FRAME_ERROR) metrics_error(ME_FRAME);
+    if (c == ER_CRC_ERROR || (c == ER_READ_ERROR && i1 != 0)) metrics_error(ME_CRC);
     switch (c) {
     case ER_OK: msg = "OK"; break;
     case ER_FILES_SCRATCHED: msg = "FILES SCRATCHED"; break;
@@ -153,6 +190,33 @@ Errorcode errtochannel15(int i) {
 }
 
 #ifdef FORKING
+static void request_dump(int x) {
+    (void)x;
+    dumprequest = 1;
+}
+
+static ssize_t supervisor_read(int fd, void *buf, size_t len) {
+    struct pollfd fds[2];
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = metricsfd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (dumprequest) {
+            dumprequest = 0;
+            metrics_dump();
+            log_flush();
+        }
+        if (poll(fds, (metricsfd >= 0) ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (fds[0].revents) return read(fd, buf, len);
+        if (fds[1].revents) metrics_serve();
+    }
+}
+
 static int partition_select2(partition_t partition) {
     if (pipefd >= 0) {
         unsigned char msg[3];
@@ -202,9 +266,7 @@ static void do_chdir(const Petscii *cmd) {
     convertfilename(outname, ',', name, NULL, NULL);
 
     if ((name[0] == '_' && name[1] == 0) || (name[0] == '.' && name[1] == '.' && name[2] == 0)) {
-        char *o = strrchr(outpath, '/');
-        if (o == NULL) o = outpath;
-        *o = 0;
+        path_parent(outpath, outpart);
         found = 1;
         goto vege2;
     }
@@ -243,6 +305,7 @@ static void do_mkdir(const Petscii *cmd) {
     int found = 0;
     Petscii name[17];
     const Petscii *outname;
+    partition_t outpart = 0;
     Directory_entry dirent;
     Directory *directory;
 
@@ -250,10 +313,13 @@ static void do_mkdir(const Petscii *cmd) {
         seterror(ER_SYNTAX_ERROR, 0); outpath[0] = 0; goto vege2;
     }
 
-    outname = resolv_path(cmd, outpath, NULL, arguments.nameconversion);
+    outname = resolv_path(cmd, outpath, &outpart, arguments.nameconversion);
     if (outname == NULL) {
         seterror(ER_PATH_NOT_FOUND, 0); goto vege2;
     }
+    if (partition_get_readonly(outpart)) {
+        seterror(ER_WRITE_PROTECT_ON, 0); goto vege2;
+    }
 
     convertfilename(outname, ',', name, NULL, NULL);
 
@@ -305,7 +371,7 @@ static void do_mkdir(const Petscii *cmd) {
             }
             f++;
         }
-        errtochannel15(mkdir(outpath, 0777));
+        errtochannel15(vfs_mkdir(outpath));
     }
 vege2:
     if (arguments.verbose) log_printf("Command: Make directory \"%s\"", outpath[0] ? outpath : "/");
@@ -316,6 +382,7 @@ static void do_scratch(const Petscii *cmd, int smode) {
     int found = 0;
     Petscii name[17], type[4] = {'*', 0};
     const Petscii *outname;
+    partition_t outpart = 0;
     Directory_entry dirent;
     Directory *directory;
 
@@ -323,10 +390,13 @@ static void do_scratch(const Petscii *cmd, int smode) {
         seterror(ER_SYNTAX_ERROR, 0); outpath[0] = 0; goto vege;
     }
 
-    outname = resolv_path(cmd, outpath, NULL, arguments.nameconversion);
+    outname = resolv_path(cmd, outpath, &outpart, arguments.nameconversion);
     if (outname == NULL) {
         seterror(ER_PATH_NOT_FOUND, 0); goto vege;
     }
+    if (partition_get_readonly(outpart)) {
+        seterror(ER_WRITE_PROTECT_ON, 0); goto vege;
+    }
 
     convertfilename(outname, '=', name, type, NULL);
 
@@ -361,9 +431,9 @@ static void do_scratch(const Petscii *cmd, int smode) {
         found = 1;
         if (smode) {
             if (arguments.verbose) log_printf("Command: Remove directory \"%s\"", path);
-            errtochannel15(rmdir(path));
+            errtochannel15(vfs_rmdir(path));
         } else {
-            errtochannel15(unlink(path));
+            errtochannel15(vfs_unlink(path));
             if (arguments.verbose) log_printf("Command: Remove \"%s\"", path);
         }
     }
@@ -379,6 +449,307 @@ vege:
     }
 }
 
+static int find_entry(const Petscii *cmd, char *outpath, partition_t *outpart, Directory_entry *dirent, int dirs) {
+    int found = 0;
+    Petscii name[17], type[4] = {'*', 0};
+    const Petscii *outname;
+    Directory *directory;
+
+    outname = resolv_path(cmd, outpath, outpart, arguments.nameconversion);
+    metrics_phase(MP_RESOLVE);
+    if (outname == NULL) {
+        seterror(ER_PATH_NOT_FOUND, 0); return -1;
+    }
+
+    convertfilename(outname, ',', name, type, NULL);
+
+    if (!name[0]) {
+        seterror(ER_MISSING_FILENAME, 0); return -1;
+    }
+
+    directory = directory_open(outpath, arguments.nameconversion, 0);
+    if (directory == NULL) {
+        errtochannel15(1); return -1;
+    }
+
+    while (directory_read(directory, dirent))
+    {
+        if (!(dirent->attrib & A_CLOSED)) continue;
+        if ((dirent->attrib & A_ANY) != A_NORMAL && (!dirs || (dirent->attrib & A_ANY) != A_DIR)) continue;
+
+        if (!matchname(dirent->name, name)) continue;
+        if (!matchname(dirent->filetype, type)) continue;
+
+        strcpy(outpath, directory_path(directory));
+        found = 1;
+        break;
+    }
+    directory_close(directory);
+    metrics_phase(MP_SCAN);
+
+    if (!found) {
+        seterror(ER_FILE_NOT_FOUND, 0); return -1;
+    }
+    return 0;
+}
+
+static int copy_data(FILE *out, int outfd, FILE *in, int fd) {
+    static unsigned char data[65536];
+    size_t r;
+
+#ifdef __linux__
+    if (fd >= 0 && outfd >= 0) {
+        if (fflush(out)) return -1;
+        for (;;) {
+            ssize_t l = copy_file_range(fd, NULL, outfd, NULL, 0x40000000, 0);
+            if (l == 0) return 0;
+            if (l < 0 && errno != EINTR) break;
+        }
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+    }
+#else
+    (void)outfd; (void)fd;
+#endif
+    for (;;) {
+        r = fread(data, 1, sizeof data, in);
+        if (r == 0) return (ferror(in) || ferror(out)) ? -1 : 0;
+        if (fwrite(data, 1, r, out) != r) return -1;
+    }
+}
+
+static void do_copy(const Petscii *cmd) {
+    char outpath[1020], lname[1000], inpath[1000];
+    Petscii line[256], name[17], type[4] = {'*', 0};
+    Petscii *src, *next;
+    const Petscii *outname;
+    FILE *in[COPY_SOURCES], *out;
+    int infd[COPY_SOURCES];
+    int found = 0, sources = 0, outfd, f;
+    partition_t outpart = 0;
+    Syncmode syncmode = arguments.syncmode;
+    unsigned int syncinterval = arguments.syncinterval;
+    Directory_entry dirent, source;
+    Directory *directory;
+
+    strncpy((char *)line, (const char *)cmd + 1, sizeof line - 1);
+    line[sizeof line - 1] = 0;
+    outpath[0] = 0;
+    src = (Petscii *)strchr((char *)line, '=');
+    if (src == NULL || !memchr(line, ':', src - line)) {
+        seterror(ER_SYNTAX_ERROR, 0); goto vege;
+    }
+    *src++ = 0;
+
+    for (; src != NULL; src = next) {
+        next = (Petscii *)strchr((char *)src, ',');
+        if (next != NULL) *next++ = 0;
+        if (sources >= COPY_SOURCES) {
+            seterror(ER_SYNTAX_ERROR, 0); goto vege;
+        }
+        if (find_entry(src, inpath, NULL, &source, 0)) goto vege;
+        in[sources] = vfs_fopen(inpath, &infd[sources]);
+        if (in[sources] == NULL) {
+            errtochannel15(1); goto vege;
+        }
+        if (arguments.verbose) log_printf("Command: Copy from \"%s\"", inpath);
+        if (!sources) memcpy(type, source.filetype, sizeof type);
+        sources++;
+    }
+
+    outname = resolv_path(line, outpath, &outpart, arguments.nameconversion);
+    if (outname == NULL) {
+        seterror(ER_PATH_NOT_FOUND, 0); goto vege;
+    }
+    if (partition_get_readonly(outpart)) {
+        seterror(ER_WRITE_PROTECT_ON, 0); goto vege;
+    }
+    partition_get_sync(outpart, &syncmode, &syncinterval);
+
+    convertfilename(outname, ',', name, type, NULL);
+
+    if (!name[0]) {
+        seterror(ER_MISSING_FILENAME, 0); goto vege;
+    }
+
+    directory = directory_open(outpath, arguments.nameconversion, 0);
+    if (directory == NULL) {
+        errtochannel15(1); goto vege;
+    }
+
+    while (directory_read(directory, &dirent))
+    {
+        if ((dirent.attrib & A_ANY) == A_DIR) continue;
+
+        if (!matchname(dirent.name, name)) continue;
+        if (!matchname(dirent.filetype, type)) continue;
+
+        found = 1;
+        break;
+    }
+    directory_close(directory);
+
+    convertc64name(lname, name, type, arguments.nameconversion);
+    if (outpath[0]) strcat(outpath, "/");
+    strcat(outpath, lname);
+
+    if (found) {
+        seterror(ER_FILE_EXISTS, 0); goto vege;
+    }
+
+    for (f = 0; lname[f]; f++) {
+        if (lname[f] == '*' || lname[f] == '?' || lname[f] == ':' || lname[f] == '=') {
+            seterror(ER_INVALID_FILENAME, 0); goto vege;
+        }
+    }
+
+    out = vfs_fopenw(outpath, O_CREAT | O_WRONLY | O_EXCL, &outfd);
+    if (out == NULL) {
+        errtochannel15(1); goto vege;
+    }
+
+    for (f = 0; f < sources; f++) {
+        if (copy_data(out, outfd, in[f], infd[f])) break;
+    }
+    if (f == sources && fflush(out)) f = -1;
+    if (f == sources && syncmode != SYNC_NONE && outfd >= 0 && fsync(outfd)) f = -1;
+    if (f != sources) {
+        errtochannel15(1);
+        log_printf("Couldn't copy to \"%s\": %s(%d)", outpath, strerror(errno), errno);
+        fclose(out);
+        vfs_unlink(outpath);
+    } else {
+        errtochannel15(fclose(out));
+    }
+vege:
+    while (sources) fclose(in[--sources]);
+    if (arguments.verbose) log_printf("Command: Copy to \"%s\"", outpath[0] ? outpath : "/");
+}
+
+static void do_rename(const Petscii *cmd) {
+    char outpath[1020], lname[1000], inpath[1000];
+    Petscii line[256], name[17], type[4] = {'*', 0};
+    Petscii *src;
+    const Petscii *outname;
+    int found = 0, f;
+    partition_t inpart = 0, outpart = 0;
+    Directory_entry dirent, source;
+    Directory *directory;
+
+    strncpy((char *)line, (const char *)cmd + 1, sizeof line - 1);
+    line[sizeof line - 1] = 0;
+    outpath[0] = inpath[0] = 0;
+    src = (Petscii *)strchr((char *)line, '=');
+    if (src == NULL || !memchr(line, ':', src - line)) {
+        seterror(ER_SYNTAX_ERROR, 0); goto vege;
+    }
+    *src++ = 0;
+
+    if (find_entry(src, inpath, &inpart, &source, 1)) goto vege;
+
+    outname = resolv_path(line, outpath, &outpart, arguments.nameconversion);
+    if (outname == NULL) {
+        seterror(ER_PATH_NOT_FOUND, 0); goto vege;
+    }
+    if (partition_get_readonly(inpart) || partition_get_readonly(outpart)) {
+        seterror(ER_WRITE_PROTECT_ON, 0); goto vege;
+    }
+
+    convertfilename(outname, ',', name, type, NULL);
+    if ((source.attrib & A_ANY) == A_DIR || type[0] == '*') memcpy(type, source.filetype, sizeof type);
+
+    if (!name[0]) {
+        seterror(ER_MISSING_FILENAME, 0); goto vege;
+    }
+
+    directory = directory_open(outpath, arguments.nameconversion, 0);
+    if (directory == NULL) {
+        errtochannel15(1); goto vege;
+    }
+
+    while (directory_read(directory, &dirent))
+    {
+        if (!matchname(dirent.name, name)) continue;
+        if (!matchname(dirent.filetype, type)) continue;
+
+        found = 1;
+        break;
+    }
+    directory_close(directory);
+
+    if ((source.attrib & A_ANY) == A_DIR) {
+        mbstate_t ps;
+        int f2;
+        memset(&ps, 0, sizeof ps);
+        for (f = f2 = 0; name[f] && f < 16; f++) {
+            f2 += c64toascii(lname + f2, name[f], &ps);
+        }
+        lname[f2] = 0;
+    } else convertc64name(lname, name, type, arguments.nameconversion);
+    if (outpath[0]) strcat(outpath, "/");
+    strcat(outpath, lname);
+
+    if (found) {
+        seterror(ER_FILE_EXISTS, 0); goto vege;
+    }
+
+    for (f = 0; lname[f]; f++) {
+        if (lname[f] == '*' || lname[f] == '?' || lname[f] == ':' || lname[f] == '=') {
+            seterror(ER_INVALID_FILENAME, 0); goto vege;
+        }
+    }
+
+    errtochannel15(vfs_rename(inpath, outpath, 0));
+vege:
+    if (arguments.verbose) log_printf("Command: Rename \"%s\" to \"%s\"", inpath, outpath[0] ? outpath : "/");
+}
+
+static void do_hash(const Petscii *cmd) {
+    char outpath[1000];
+    unsigned long crc;
+    int fd, i, channel = 0;
+    Directory_entry dirent;
+    FILE *file;
+
+    outpath[0] = 0;
+    if (cmd[1] == '#') {
+        for (i = 2; (cmd[i] ^ 0x30) < 10; i++) channel = channel * 10 + (cmd[i] ^ 0x30);
+        if (i == 2 || cmd[i] || channel > 14) {
+            seterror(ER_SYNTAX_ERROR, 0); goto vege;
+        }
+        sprintf(outpath, "#%d", channel);
+        if (buff[channel].mode != CM_FILE || buff[channel].file == NULL) {
+            seterror(ER_NO_CHANNEL, 0); goto vege;
+        }
+        if (buffer_writeback(&buff[channel])) errno = buff[channel].werror;
+        if (buff[channel].werror) {
+            errtochannel15(1); goto vege;
+        }
+        if (buff[channel].fd >= 0 ? hash_fd(buff[channel].fd, &crc, 0) : hash_file(buff[channel].file, &crc)) {
+            errtochannel15(1); goto vege;
+        }
+    } else {
+        if (!strchr((char *)cmd, ':')) {
+            seterror(ER_SYNTAX_ERROR, 0); goto vege;
+        }
+        if (find_entry(cmd + 1, outpath, NULL, &dirent, 0)) goto vege;
+        file = vfs_fopen(outpath, &fd);
+        if (file == NULL) {
+            errtochannel15(1); goto vege;
+        }
+        i = (fd >= 0) ? hash_fd(fd, &crc, 1) : hash_file(file, &crc);
+        fclose(file);
+        if (i) {
+            errtochannel15(1); goto vege;
+        }
+    }
+    buff[15].size = sprintf((char *)buff[15].data, "%02d, %08lX,000,000,000,000", ER_OK, crc);
+    buff[15].pointer = 0;
+    if (arguments.verbose) log_printf("Command: Hash \"%s\" %08lX", outpath, crc);
+    return;
+vege:
+    if (arguments.verbose) log_printf("Command: Hash \"%s\"", outpath);
+}
+
 void commandchannel(const Petscii *s) {
     if (s[0] == 'C' && s[1] == 'D') {
         do_chdir(s + 2);
@@ -399,6 +770,12 @@ void commandchannel(const Petscii *s) {
         }
         if (arguments.verbose) log_printf("Command: Change to partition %d", part);
         seterror(partition_select2(part) ? ER_SELECTED_PARTITION_ILLEGAL : ER_PARTITION_SELECTED, part);
+    } else if (s[0] == 'C' && strchr((char *)s, '=')) {
+        do_copy(s);
+    } else if (s[0] == 'R' && strchr((char *)s, '=')) {
+        do_rename(s);
+    } else if (s[0] == 'H') {
+        do_hash(s);
     } else if (s[0] == 'U' && ((s[1] & 0x0f) == 9 || (s[1] & 0x0f) == 10)) {
         seterror(ER_DOS_VERSION, 0);
         if (arguments.verbose) log_print("Command: Identify device");
@@ -420,17 +797,69 @@ void commandchannel(const Petscii *s) {
     }
 }
 
-static void init(int argc, char *argv[]) {
 #ifndef WIN32
+void drop_privileges(int lastfail) {
+    static int dropped;
     struct passwd *user2 = NULL;
     struct group *group2 = NULL;
+
+    if (dropped) return;
+    dropped = 1;
+    if (!arguments.user || !arguments.group) {
+        uid_t uid = getuid(), euid = geteuid();
+        if (uid <= 0 || uid != euid) {
+            if (!arguments.user) arguments.user = "nobody";
+            if (!arguments.group) arguments.group = "nogroup";
+        }
+    }
+    if (arguments.user && !(user2 = getpwnam(arguments.user))) {
+        if (lastfail != 3) log_printf("User \"%s\" does not exist", arguments.user);
+        exit(3);
+    }
+    if (arguments.group && !(group2 = getgrnam(arguments.group))) {
+        if (lastfail != 4) log_printf("Group \"%s\" does not exist", arguments.group);
+        exit(4);
+    }
+    if (arguments.root) {
+        uid_t uid = getuid(), euid = geteuid();
+        if (chdir(arguments.root)) {
+            if (lastfail != 5) log_printf("Changing dir to \"%s\" failed: %s(%d)", arguments.root, strerror(errno), errno);
+            exit(5);
+        } else {
+            if (chroot(arguments.root) || chdir("/")) {
+                if (uid <= 0 || uid != euid) {
+                    if (lastfail != 6) log_printf("Chrooting failed: %s(%d)", strerror(errno), errno);
+                    exit(6);
+                }
+                log_printf("Chrooting failed: %s(%d)", strerror(errno), errno);
+            }
+        }
+    }
+    if ((group2 && setgid(group2->gr_gid)) || (user2 && setuid(user2->pw_uid))) {
+        if (lastfail != 7) log_printf("Could not drop privileges: %s(%d)", strerror(errno), errno);
+        exit(7);
+    }
+}
+#endif
+
+static void init(int argc, char *argv[]) {
+#ifndef WIN32
     int lastfail = 0;
 #endif
 
     setlocale(LC_CTYPE, "");
 
     testarg(&arguments, argc, argv);
-    partition_create(1, (Petscii *)"PARTITION 1");
+    partition_create(1, (Petscii *)"PARTITION 1", "");
+    if (arguments.ramdisk != 0) {
+        const char *root = ram_create(arguments.ramdisk);
+        if (root == NULL) {
+            message("Couldn't create the RAM disk: %s(%d)\n", strerror(errno), errno);
+            exit(EXIT_FAILURE);
+        }
+        partition_create(2, (Petscii *)"RAMDISK", root);
+    }
+    if (arguments.partitions != NULL && partition_load(arguments.partitions)) exit(EXIT_FAILURE);
     partition_select(1);
 
     log_open(arguments.log);
@@ -454,12 +883,22 @@ static void init(int argc, char *argv[]) {
 #ifdef _USB_H
             {"usb", M_USB},
 #endif
+#if defined _USB_H && defined FORKING
+            {"usblisten", M_USBLISTEN},
+#endif
 #ifdef _VICE_H
             {"vice", M_VICE},
 #endif
+#if defined _VICE_H && defined FORKING
+            {"vicelisten", M_VICELISTEN},
+#endif
+#ifdef _SHM_H
+            {"shm", M_SHM},
+#endif
 #ifdef _ETH_H
             {"eth", M_ETHERNET},
 #endif
+            {"replay", M_REPLAY}, {"replayrt", M_REPLAYRT},
             {NULL, M_NONE}
         };
         i = modes;
@@ -514,20 +953,42 @@ static void init(int argc, char *argv[]) {
         driver = usb_driver(arguments.device);
         break;
 #endif
+#if defined _USB_H && defined FORKING
+    case M_USBLISTEN:
+        driver = usb_listen_driver(arguments.device);
+        break;
+#endif
 #ifdef _VICE_H
     case M_VICE:
         driver = vice_driver(arguments.sin_addr, arguments.network);
         break;
 #endif
+#if defined _VICE_H && defined FORKING
+    case M_VICELISTEN:
+        driver = vice_listen_driver(arguments.sin_addr, arguments.network);
+        break;
+#endif
+#ifdef _SHM_H
+    case M_SHM:
+        driver = shm_driver(arguments.sin_addr);
+        break;
+#endif
 #ifdef _ETH_H
     case M_ETHERNET:
         driver = eth_driver(arguments.sin_addr, arguments.network);
         break;
 #endif
+    case M_REPLAY:
+        driver = replay_driver(arguments.sin_addr, 0);
+        break;
+    case M_REPLAYRT:
+        driver = replay_driver(arguments.sin_addr, 1);
+        break;
     default:
         message("No driver for unknown mode \"%s\"\n", arguments.mode_name);
         exit(EXIT_FAILURE);
     }
+    arguments.protocol = arguments.mode;
 
 #ifdef WIN32
     if (chdir(arguments.root ? arguments.root : "/cygdrive")) {
@@ -551,7 +1012,14 @@ static void init(int argc, char *argv[]) {
             exit(EXIT_SUCCESS);
         }
     }
-    for (;;) {
+    metricsfd = metrics_open(arguments.metrics);
+    driver = metrics_driver(driver);
+    if (arguments.mode == M_VICELISTEN || arguments.mode == M_USBLISTEN) {
+        hash_share();
+        vfs_share();
+    }
+    signal(SIGUSR1, request_dump);
+    while (arguments.mode != M_REPLAY && arguments.mode != M_REPLAYRT) {
         pid_t pid;
         int pipefds[2];
         if (pipe(pipefds) == -1) {
@@ -561,6 +1029,9 @@ static void init(int argc, char *argv[]) {
         pid = fork();
         if (pid == 0) {
             if (pipefds[0] >= 0) close(pipefds[0]);
+            if (metricsfd >= 0) close(metricsfd);
+            metricsfd = -1;
+            signal(SIGUSR1, SIG_IGN);
             pipefd = pipefds[1];
             break;
         }
@@ -570,7 +1041,7 @@ static void init(int argc, char *argv[]) {
             int status;
             if (pipefds[0] >= 0) {
                 unsigned char msg[3];
-                while (read(pipefds[0], &msg, sizeof msg) == sizeof msg) {
+                while (supervisor_read(pipefds[0], &msg, sizeof msg) == sizeof msg) {
                     if (msg[0] == 1) {
                         char path[256];
                         unsigned int c = (msg[2] != 0) ? read(pipefds[0], path, msg[2]) : 0;
@@ -598,45 +1069,22 @@ static void init(int argc, char *argv[]) {
         if (change) exit(thisfail);
         usleep(1000000);
     }
+    if (arguments.mode == M_REPLAY || arguments.mode == M_REPLAYRT) arguments.protocol = replay_mode();
+    metrics_session(arguments.mode_name ? arguments.mode_name : driver->name);
+    trace_open(arguments.trace, arguments.protocol);
+    driver = trace_driver(driver);
+#ifdef FORKING
+    if ((arguments.mode == M_VICELISTEN || arguments.mode == M_USBLISTEN) && pipefd >= 0) {
+        close(pipefd);
+        pipefd = -1;
+    }
+#endif
 
     errno = 0;
     if (arguments.priority && nice(arguments.priority) == -1 && errno != 0) {
         log_printf("Couldn't adjust priority: %s(%d)", strerror(errno), errno);
     }
-    if (!arguments.user || !arguments.group) {
-        uid_t uid = getuid(), euid = geteuid();
-        if (uid <= 0 || uid != euid) {
-            if (!arguments.user) arguments.user = "nobody";
-            if (!arguments.group) arguments.group = "nogroup";
-        }
-    }
-    if (arguments.user && !(user2 = getpwnam(arguments.user))) {
-        if (lastfail != 3) log_printf("User \"%s\" does not exist", arguments.user);
-        exit(3);
-    }
-    if (arguments.group && !(group2 = getgrnam(arguments.group))) {
-        if (lastfail != 4) log_printf("Group \"%s\" does not exist", arguments.group);
-        exit(4);
-    }
-    if (arguments.root) {
-        uid_t uid = getuid(), euid = geteuid();
-        if (chdir(arguments.root)) {
-            if (lastfail != 5) log_printf("Changing dir to \"%s\" failed: %s(%d)", arguments.root, strerror(errno), errno);
-            exit(5);
-        } else {
-            if (chroot(arguments.root) || chdir("/")) {
-                if (uid <= 0 || uid != euid) {
-                    if (lastfail != 6) log_printf("Chrooting failed: %s(%d)", strerror(errno), errno);
-                    exit(6);
-                }
-                log_printf("Chrooting failed: %s(%d)", strerror(errno), errno);
-            }
-        }
-    }
-    if ((group2 && setgid(group2->gr_gid)) || (user2 && setuid(user2->pw_uid))) {
-        if (lastfail != 7) log_printf("Could not drop privileges: %s(%d)", strerror(errno), errno);
-        exit(7);
-    }
+    drop_privileges(lastfail);
 #endif
 }
 
@@ -801,35 +1249,46 @@ static long WINAPI PCLinkLoop(long lParam) {
             }
             continue;
 #else
-            terminate(0);
+            if (reconnect()) terminate(0);
+            continue;
 #endif
         }
 
         switch (b) {
         case 0x00: goto start2;
         case 'N': crc_clear(-1); /* fall through */
-        case 0xCE: b = openfile(driver, buff, &arguments, b == 0xCE ? FLAG_USE_CRC : 0); ec = 0x5a; break;
+        case 0xCE: metrics_begin(MC_OPEN, 0); b = openfile(driver, buff, &arguments, b == 0xCE ? FLAG_USE_CRC : 0); ec = 0x5a; break;
         case 'G': crc_clear(-1); /* fall through */
-        case 0xC7: b = readfile(driver, buff, &arguments, b == 0xC7 ? FLAG_USE_CRC : 0); ec = 0x5a; break;
+        case 0xC7: metrics_begin(MC_READ, 0); b = readfile(driver, buff, &arguments, b == 0xC7 ? FLAG_USE_CRC : 0); ec = 0x5a; break;
         case 'P': crc_clear(-1); /* fall through */
         case 'S': crc_clear(-1); /* fall through */
-        case 0xD3: b = writefile(driver, buff, &arguments, b == 0xD3 ? FLAG_USE_CRC : b == 'P' ? FLAG_USE_PADDING : 0); ec = 0x5a; break;
+        case 0xD3: metrics_begin(MC_WRITE, 0); b = writefile(driver, buff, &arguments, b == 0xD3 ? FLAG_USE_CRC : b == 'P' ? FLAG_USE_PADDING : 0); ec = 0x5a; break;
         case 'D': crc_clear(-1); /* fall through */
-        case 0xC4: b = closefile(driver, buff, &arguments, b == 0xC4 ? FLAG_USE_CRC : 0); ec = 0x5a; break;
+        case 0xC4: metrics_begin(MC_CLOSE, 0); b = closefile(driver, buff, &arguments, b == 0xC4 ? FLAG_USE_CRC : 0); ec = 0x5a; break;
         case 'I': crc_clear(-1); /* fall through */
-        case 0xC9: b = statuserror(driver, (char *)buff[15].data, &arguments, b == 0xC9 ? FLAG_USE_CRC : 0); ec = 0x5a; break;
+        case 0xC9: metrics_begin(MC_STATUS, 0); b = statuserror(driver, (char *)buff[15].data, &arguments, b == 0xC9 ? FLAG_USE_CRC : 0); ec = 0x5a; break;
         case 'O': crc_clear(-1); /* fall through */
-        case 0xCF: b = openfile_compat(driver, buff, &arguments, b == 0xCF ? FLAG_USE_CRC : 0); ec = 0; break;
+        case 0xCF: metrics_begin(MC_OPEN, 1); b = openfile_compat(driver, buff, &arguments, b == 0xCF ? FLAG_USE_CRC : 0); ec = 0; break;
         case 'R': crc_clear(-1); /* fall through */
-        case 0xD2: b = readfile_compat(driver, buff, &arguments, b == 0xD2 ? FLAG_USE_CRC : 0); ec = 0; break;
+        case 0xD2: metrics_begin(MC_READ, 1); b = readfile_compat(driver, buff, &arguments, b == 0xD2 ? FLAG_USE_CRC : 0); ec = 0; break;
         case 'W': crc_clear(-1); /* fall through */
-        case 0xD7: b = writefile_compat(driver, buff, &arguments, b == 0xD7 ? FLAG_USE_CRC : 0); ec = 0; break;
+        case 0xD7: metrics_begin(MC_WRITE, 1); b = writefile_compat(driver, buff, &arguments, b == 0xD7 ? FLAG_USE_CRC : 0); ec = 0; break;
         case 'C': crc_clear(-1); /* fall through */
-        case 0xC3: b = closefile_compat(driver, buff, &arguments, b == 0xC3 ? FLAG_USE_CRC : 0); ec = 0; break;
+        case 0xC3: metrics_begin(MC_CLOSE, 1); b = closefile_compat(driver, buff, &arguments, b == 0xC3 ? FLAG_USE_CRC : 0); ec = 0; break;
         default: log_printf("Unknown command %02X", b);
         }
+        metrics_end(b);
+        trace_end(b);
+        {
+            int i, channels = 0;
+            for (i = 0; i < 15; i++) channels += buff[i].mode != CM_CLOSED;
+            metrics_channels(channels);
+        }
         if (b) {
-            if (driver->clean()) log_print("Timeout");
+            if (driver->clean()) {
+                log_print("Timeout");
+                metrics_error(ME_TIMEOUT);
+            }
         }
     }
     return 0;
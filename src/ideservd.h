@@ -66,4 +66,5 @@ typedef enum Errorcode {
 extern Errorcode errtochannel15(int);
 extern void seterror(Errorcode, int);
 extern void commandchannel(const Petscii *);
+extern void drop_privileges(int);
 #endif
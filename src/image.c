@@ -0,0 +1,187 @@
+/*
+
+ image.c - Read only access to the files of .d64, .d71 and .d81 disk images
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "image.h"
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include "path.h"
+
+typedef struct Image {
+    unsigned long *sectors;
+    unsigned long count;
+} Image;
+
+static const char *const types[] = {"del", "seq", "prg", "usr", "rel"};
+
+static int probe(const char *name, size_t len) {
+    return vfs_extension(name, len, "d64") || vfs_extension(name, len, "d71") || vfs_extension(name, len, "d81");
+}
+
+static unsigned int track_sectors(int d81, unsigned int tracks, unsigned int track) {
+    if (d81) return 40;
+    if (tracks == 70 && track > 35) track -= 35;
+    if (track < 18) return 21;
+    if (track < 25) return 19;
+    if (track < 31) return 18;
+    return 17;
+}
+
+static long sector_offset(const Vfs_container *c, int d81, unsigned int tracks, unsigned int track, unsigned int sector) {
+    unsigned long offset = 0;
+    unsigned int t;
+    if (track == 0 || track > tracks || sector >= track_sectors(d81, tracks, track)) return -1;
+    if (d81) {
+        offset = ((track - 1) * 40 + sector) * 256;
+    } else {
+        if (track > 35 && tracks == 70) {
+            offset = 683 * 256;
+            track -= 35;
+        }
+        for (t = 1; t < track; t++) offset += track_sectors(0, tracks, t) * 256;
+        offset += sector * 256;
+    }
+    if (offset + 256 > c->datalen) return -1;
+    return offset;
+}
+
+static int push(Image *image, unsigned long *capacity, unsigned long offset) {
+    if (image->count == *capacity) {
+        unsigned long *s;
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        s = (unsigned long *)realloc(image->sectors, *capacity * sizeof *s);
+        if (s == NULL) return -1;
+        image->sectors = s;
+    }
+    image->sectors[image->count++] = offset;
+    return 0;
+}
+
+static int load(Vfs_container *c) {
+    int d81;
+    unsigned int tracks, t, s, blocks;
+    unsigned long capacity = 0;
+    long offset;
+    unsigned char *seen, *dirseen;
+    Image *image;
+
+    switch (c->datalen) {
+    case 174848: case 175531: tracks = 35; d81 = 0; break;
+    case 196608: case 197376: tracks = 40; d81 = 0; break;
+    case 349696: case 351062: tracks = 70; d81 = 0; break;
+    case 819200: case 822400: tracks = 80; d81 = 1; break;
+    default: return -1;
+    }
+    blocks = c->datalen / 256;
+    seen = (unsigned char *)calloc(blocks, 2);
+    image = (Image *)calloc(1, sizeof *image);
+    if (seen == NULL || image == NULL) {
+        free(seen);
+        free(image);
+        return -1;
+    }
+    c->priv = image;
+    dirseen = seen + blocks;
+
+    offset = sector_offset(c, d81, tracks, d81 ? 40 : 18, 0);
+    t = c->data[offset]; s = c->data[offset + 1];
+    while ((offset = sector_offset(c, d81, tracks, t, s)) >= 0 && !dirseen[offset / 256]) {
+        const unsigned char *dir = c->data + offset;
+        unsigned int i;
+        dirseen[offset / 256] = 1;
+        for (i = 0; i < 256; i += 32) {
+            const unsigned char *e = dir + i;
+            char name[16 * 10 + 8];
+            size_t l = 0;
+            unsigned int j;
+            unsigned long first, size;
+            long o;
+            mbstate_t ps;
+            int n;
+
+            if ((e[2] & 0x80) == 0 || (e[2] & 7) > 4) continue;
+            memset(&ps, 0, sizeof ps);
+            for (j = 0; j < 16 && e[5 + j] != 0xa0; j++) l += c64toascii(name + l, e[5 + j], &ps);
+            if (l == 0) continue;
+            name[l++] = ',';
+            memcpy(name + l, types[e[2] & 7], 3);
+            l += 3;
+
+            first = image->count;
+            size = 0;
+            memset(seen, 0, blocks);
+            for (o = sector_offset(c, d81, tracks, e[3], e[4]); o >= 0 && !seen[o / 256]; o = sector_offset(c, d81, tracks, c->data[o], c->data[o + 1])) {
+                seen[o / 256] = 1;
+                if (push(image, &capacity, o)) break;
+                if (c->data[o] == 0) {
+                    size += c->data[o + 1] > 1 ? c->data[o + 1] - 1 : 0;
+                    break;
+                }
+                size += 254;
+            }
+            n = vfs_add(c, name, l, 0, size, c->mtime);
+            if (n < 0) {
+                image->count = first;
+                continue;
+            }
+            c->entries[n].offset = first;
+            c->entries[n].length = image->count - first;
+        }
+        t = dir[0]; s = dir[1];
+    }
+    free(seen);
+    return 0;
+}
+
+static size_t read_data(Vfs_container *c, const Vfs_entry *e, unsigned long pos, unsigned char *buf, size_t len) {
+    const Image *image = (const Image *)c->priv;
+    size_t done = 0;
+    while (done < len) {
+        unsigned long n = pos / 254, l;
+        unsigned int in = pos % 254;
+        if (n >= e->length) break;
+        l = 254 - in;
+        if (l > len - done) l = len - done;
+        memcpy(buf + done, c->data + image->sectors[e->offset + n] + 2 + in, l);
+        done += l;
+        pos += l;
+    }
+    return done;
+}
+
+static void release(Vfs_container *c) {
+    Image *image = (Image *)c->priv;
+    if (image == NULL) return;
+    free(image->sectors);
+    free(image);
+}
+
+static const Vfs_backend backend = {
+    probe,
+    load,
+    read_data,
+    release,
+    0
+};
+
+const Vfs_backend *image_backend(void) {
+    return &backend;
+}
@@ -0,0 +1,65 @@
+/*
+
+ memrev.c - Copying of buffers in reversed byte order
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "memrev.h"
+#include <string.h>
+
+#if (defined __x86_64__ || defined __i386__) && ((defined __GNUC__ && __GNUC__ >= 5) || defined __clang__)
+#define MEMREV_SSSE3
+#include <tmmintrin.h>
+#endif
+
+static size_t memrevcpy_scalar(unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t i = 0;
+#ifdef __GNUC__
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long w;
+        memcpy(&w, src + len - i - 8, 8);
+        w = __builtin_bswap64(w);
+        memcpy(dst + i, &w, 8);
+    }
+#endif
+    for (; i < len; i++) dst[i] = src[len - i - 1];
+    return i;
+}
+
+#ifdef MEMREV_SSSE3
+__attribute__((target("ssse3")))
+static size_t memrevcpy_ssse3(unsigned char *dst, const unsigned char *src, size_t len) {
+    const __m128i mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + len - i - 16));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+#endif
+
+void memrevcpy(unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t i = 0;
+#ifdef MEMREV_SSSE3
+    static int ssse3 = -1;
+    if (ssse3 < 0) ssse3 = __builtin_cpu_supports("ssse3") != 0;
+    if (ssse3) i = memrevcpy_ssse3(dst, src, len);
+#endif
+    memrevcpy_scalar(dst + i, src, len - i);
+}
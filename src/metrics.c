@@ -0,0 +1,430 @@
+/*
+
+ metrics.c - Command counters and latency histograms in shared memory
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "metrics.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#if !defined WIN32 && !defined __DJGPP__
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define METRICS_SHARED
+#endif
+#include "driver.h"
+#include "log.h"
+
+#define METRICS_SESSIONS 32
+#define HIST_BUCKETS 320
+
+#if defined METRICS_SHARED && defined __GNUC__
+#define metrics_add(a, b) __atomic_fetch_add(&(a), (b), __ATOMIC_RELAXED)
+#define metrics_set(a, b) __atomic_store_n(&(a), (b), __ATOMIC_RELAXED)
+#else
+#define metrics_add(a, b) ((a) += (b))
+#define metrics_set(a, b) ((a) = (b))
+#endif
+
+typedef unsigned long long Counter;
+
+typedef struct Metricset {
+    Counter ops[MC_COMMANDS][2];
+    Counter failed[MC_COMMANDS][2];
+    Counter rx[MC_COMMANDS][2];
+    Counter tx[MC_COMMANDS][2];
+    Counter errors[ME_ERRORS];
+    Counter hits, misses;
+    Counter channels;
+} Metricset;
+
+typedef struct Metricsession {
+    int pid;
+    Metricset set;
+} Metricsession;
+
+typedef struct Metrics {
+    char transport[16];
+    Counter hist[MC_COMMANDS][MP_PHASES][HIST_BUCKETS];
+    Counter histsum[MC_COMMANDS][MP_PHASES];
+    Metricset total;
+    Metricsession session[METRICS_SESSIONS];
+} Metrics;
+
+static const char *command_names[MC_COMMANDS] = {"none", "open", "read", "write", "close", "status"};
+static const char *error_names[ME_ERRORS] = {"frame", "crc", "timeout"};
+static const char *phase_names[MP_PHASES] = {"receive", "resolve", "scan", "io", "reply", "total"};
+
+static Metrics local;
+static Metrics *metrics = &local;
+static Metricset *session;
+static Metric_command command;
+static int compat;
+static int listener = -1;
+static unsigned long long started, last, spent[MP_PHASES];
+static unsigned int phases;
+
+#define metrics_count(field, value) do { \
+    metrics_add(metrics->total.field, value); \
+    if (session != NULL) metrics_add(session->field, value); \
+} while (0)
+
+static unsigned long long metrics_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000000ull + tv.tv_usec * 1000ull;
+    }
+}
+
+static unsigned int hist_bucket(unsigned long long v) {
+    unsigned int s = 0;
+    if (v < 8) return v;
+    while ((v >> s) >= 16) s++;
+    s = (s + 1) * 8 + (unsigned int)(v >> s) - 8;
+    return (s < HIST_BUCKETS) ? s : HIST_BUCKETS - 1;
+}
+
+static unsigned long long hist_limit(unsigned int i) {
+    if (i < 8) return i + 1;
+    return (unsigned long long)(i % 8 + 9) << (i / 8 - 1);
+}
+
+int metrics_open(const char *path) {
+#ifdef METRICS_SHARED
+    struct sockaddr_un addr;
+    Metrics *shared;
+
+    if (path != NULL && strlen(path) >= sizeof addr.sun_path) {
+        log_printf("Metrics socket path \"%s\" is too long", path);
+        return -1;
+    }
+    shared = (Metrics *)mmap(NULL, sizeof *shared, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        log_printf("Couldn't map metrics: %s(%d)", strerror(errno), errno);
+        return -1;
+    }
+    metrics = shared;
+    if (path == NULL) return -1;
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        log_printf("Couldn't create metrics socket: %s(%d)", strerror(errno), errno);
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof addr) || listen(listener, 4)) {
+        log_printf("Couldn't listen on metrics socket \"%s\": %s(%d)", path, strerror(errno), errno);
+        close(listener);
+        listener = -1;
+        return -1;
+    }
+    return listener;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+#ifdef METRICS_SHARED
+typedef struct Metricout {
+    const Metricset *set;
+    char labels[64];
+} Metricout;
+
+static void print_commands(FILE *f, const Metricout *out, int n, const char *name, size_t offset, int ops) {
+    int i, j, k;
+
+    fprintf(f, "# TYPE %s counter\n", name);
+    for (k = 0; k < n; k++) {
+        const Counter (*c)[2] = (const Counter (*)[2])((const char *)out[k].set + offset);
+        for (i = 0; i < MC_COMMANDS; i++) {
+            for (j = 0; j < 2; j++) {
+                if (ops ? !out[k].set->ops[i][j] : !out[k].set->rx[i][j] && !out[k].set->tx[i][j]) continue;
+                fprintf(f, "%s{%s,command=\"%s\",protocol=\"%s\"} %llu\n", name, out[k].labels, command_names[i], j ? "compat" : "normal", c[i][j]);
+            }
+        }
+    }
+}
+
+#endif
+
+void metrics_serve(void) {
+#ifdef METRICS_SHARED
+    Metricout out[METRICS_SESSIONS + 1];
+    struct timeval tv;
+    Counter channels = 0;
+    int i, n;
+    FILE *f;
+    int conn = accept(listener, NULL, NULL);
+
+    if (conn < 0) return;
+    tv.tv_sec = 1; tv.tv_usec = 0;
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    f = fdopen(conn, "w");
+    if (f == NULL) {
+        close(conn);
+        return;
+    }
+
+    out[0].set = &metrics->total;
+    snprintf(out[0].labels, sizeof out[0].labels, "transport=\"%s\"", metrics->transport);
+    for (i = 0, n = 1; i < METRICS_SESSIONS; i++) {
+        Metricsession *s = &metrics->session[i];
+        if (s->pid <= 0 || (kill(s->pid, 0) && errno == ESRCH)) continue;
+        out[n].set = &s->set;
+        snprintf(out[n].labels, sizeof out[n].labels, "transport=\"%s\",session=\"%d\"", metrics->transport, s->pid);
+        channels += s->set.channels;
+        n++;
+    }
+
+    print_commands(f, out, n, "ideservd_commands_total", offsetof(Metricset, ops), 1);
+    print_commands(f, out, n, "ideservd_command_errors_total", offsetof(Metricset, failed), 1);
+    print_commands(f, out, n, "ideservd_received_bytes_total", offsetof(Metricset, rx), 0);
+    print_commands(f, out, n, "ideservd_sent_bytes_total", offsetof(Metricset, tx), 0);
+    fprintf(f, "# TYPE ideservd_link_errors_total counter\n");
+    for (i = 0; i < n; i++) {
+        int j;
+        for (j = 0; j < ME_ERRORS; j++) {
+            fprintf(f, "ideservd_link_errors_total{%s,type=\"%s\"} %llu\n", out[i].labels, error_names[j], out[i].set->errors[j]);
+        }
+    }
+    fprintf(f, "# TYPE ideservd_hash_cache_hits_total counter\n");
+    for (i = 0; i < n; i++) fprintf(f, "ideservd_hash_cache_hits_total{%s} %llu\n", out[i].labels, out[i].set->hits);
+    fprintf(f, "# TYPE ideservd_hash_cache_misses_total counter\n");
+    for (i = 0; i < n; i++) fprintf(f, "ideservd_hash_cache_misses_total{%s} %llu\n", out[i].labels, out[i].set->misses);
+    fprintf(f, "# TYPE ideservd_channels_open gauge\n");
+    fprintf(f, "ideservd_channels_open{%s} %llu\n", out[0].labels, channels);
+    for (i = 1; i < n; i++) fprintf(f, "ideservd_channels_open{%s} %llu\n", out[i].labels, out[i].set->channels);
+    fprintf(f, "# TYPE ideservd_sessions gauge\n");
+    fprintf(f, "ideservd_sessions{%s} %d\n", out[0].labels, n - 1);
+    fprintf(f, "# TYPE ideservd_latency_seconds histogram\n");
+    for (i = MC_OPEN; i < MC_COMMANDS; i++) {
+        int p;
+        for (p = 0; p < MP_PHASES; p++) {
+            const Counter *h = metrics->hist[i][p];
+            Counter count = 0;
+            unsigned int j, top = 0;
+            for (j = 0; j < HIST_BUCKETS; j++) {
+                if (h[j]) top = j;
+            }
+            for (j = 0; j <= top; j++) {
+                count += h[j];
+                if (j % 8 != 7 || hist_limit(j) < 1024) continue;
+                fprintf(f, "ideservd_latency_seconds_bucket{%s,command=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n", out[0].labels, command_names[i], phase_names[p], hist_limit(j) / 1e9, count);
+            }
+            if (count == 0) continue;
+            fprintf(f, "ideservd_latency_seconds_bucket{%s,command=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n", out[0].labels, command_names[i], phase_names[p], count);
+            fprintf(f, "ideservd_latency_seconds_sum{%s,command=\"%s\",phase=\"%s\"} %g\n", out[0].labels, command_names[i], phase_names[p], metrics->histsum[i][p] / 1e9);
+            fprintf(f, "ideservd_latency_seconds_count{%s,command=\"%s\",phase=\"%s\"} %llu\n", out[0].labels, command_names[i], phase_names[p], count);
+        }
+    }
+    fclose(f);
+#endif
+}
+
+void metrics_session(const char *transport) {
+    Metricsession *s = metrics->session;
+    int i, pid = getpid();
+
+    strncpy(metrics->transport, transport, sizeof metrics->transport - 1);
+    if (metrics == &local) return;
+    for (i = 0; i < METRICS_SESSIONS; i++, s++) {
+#ifdef METRICS_SHARED
+        int old = s->pid;
+        if (old > 0 && (kill(old, 0) == 0 || errno != ESRCH)) continue;
+        if (!__atomic_compare_exchange_n(&s->pid, &old, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+#endif
+        memset(&s->set, 0, sizeof s->set);
+        session = &s->set;
+        return;
+    }
+}
+
+static const Driver *inner;
+static Driver wrapper;
+
+static int m_initialize(int lastfail) {
+    return inner->initialize(lastfail);
+}
+
+static int m_getb(int a) {
+    int c = inner->getb(a);
+    if (c != EOF) metrics_count(rx[command][compat], 1);
+    return c;
+}
+
+static void m_sendb(unsigned char c) {
+    metrics_count(tx[command][compat], 1);
+    inner->sendb(c);
+}
+
+static void m_getbytes(unsigned char data[], unsigned int len) {
+    metrics_count(rx[command][compat], len);
+    inner->getbytes(data, len);
+}
+
+static void m_sendbytes(const unsigned char data[], unsigned int len) {
+    metrics_count(tx[command][compat], len);
+    inner->sendbytes(data, len);
+}
+
+static void m_sendrbytes(const unsigned char data[], unsigned int len) {
+    metrics_count(tx[command][compat], len);
+    inner->sendrbytes(data, len);
+}
+
+static void m_shutdown(void) {
+    inner->shutdown();
+}
+
+static int m_flush(void) {
+    return inner->flush();
+}
+
+static int m_done(void) {
+    return inner->done();
+}
+
+static void m_turn(void) {
+    inner->turn();
+}
+
+static int m_wait(unsigned char ec) {
+    int c = inner->wait(ec);
+    if (c >= 0) metrics_count(rx[MC_NONE][0], 1);
+    return c;
+}
+
+static int m_clean(void) {
+    return inner->clean();
+}
+
+const Driver *metrics_driver(const Driver *driver) {
+    if (listener < 0) return driver;
+    inner = driver;
+    wrapper.name = driver->name;
+    wrapper.initialize = m_initialize;
+    wrapper.getb = m_getb;
+    wrapper.sendb = m_sendb;
+    wrapper.getbytes = m_getbytes;
+    wrapper.sendbytes = m_sendbytes;
+    wrapper.sendrbytes = m_sendrbytes;
+    wrapper.shutdown = m_shutdown;
+    wrapper.flush = m_flush;
+    wrapper.done = m_done;
+    wrapper.turn = m_turn;
+    wrapper.wait = m_wait;
+    wrapper.clean = m_clean;
+    return &wrapper;
+}
+
+void metrics_begin(Metric_command c, int compat2) {
+    command = c;
+    compat = compat2 != 0;
+    metrics_count(ops[c][compat], 1);
+    started = last = metrics_now();
+    phases = 0;
+}
+
+void metrics_phase(Metric_phase p) {
+    unsigned long long now = metrics_now();
+    if (!(phases & (1 << p))) spent[p] = 0;
+    spent[p] += now - last;
+    phases |= 1 << p;
+    last = now;
+}
+
+void metrics_end(int fail) {
+    int p;
+
+    if (fail) metrics_count(failed[command][compat], 1);
+    if (command != MC_NONE) {
+        metrics_phase(MP_REPLY);
+        spent[MP_TOTAL] = last - started;
+        phases |= 1 << MP_TOTAL;
+        for (p = 0; p < MP_PHASES; p++) {
+            if (!(phases & (1 << p))) continue;
+            metrics_add(metrics->hist[command][p][hist_bucket(spent[p])], 1);
+            metrics_add(metrics->histsum[command][p], spent[p]);
+        }
+    }
+    command = MC_NONE;
+    compat = 0;
+}
+
+static void format_time(char *s, unsigned long long v) {
+    if (v >= 10000000) sprintf(s, "%llums", (v + 500000) / 1000000);
+    else if (v >= 10000) sprintf(s, "%lluus", (v + 500) / 1000);
+    else sprintf(s, "%lluns", v);
+}
+
+void metrics_dump(void) {
+    int c, p;
+    unsigned int i;
+
+    for (c = MC_OPEN; c < MC_COMMANDS; c++) {
+        for (p = 0; p < MP_PHASES; p++) {
+            const Counter *h = metrics->hist[c][p];
+            static const unsigned int quantiles[3] = {50, 90, 99};
+            char q[3][16], mean[16], max[16];
+            Counter count = 0, sum = 0;
+            unsigned int j = 0, top = 0;
+
+            for (i = 0; i < HIST_BUCKETS; i++) {
+                if (h[i]) top = i;
+                count += h[i];
+            }
+            if (count == 0) continue;
+            for (i = 0; i < HIST_BUCKETS && j < 3; i++) {
+                sum += h[i];
+                while (j < 3 && sum * 100 >= count * quantiles[j]) format_time(q[j++], hist_limit(i));
+            }
+            format_time(mean, metrics->histsum[c][p] / count);
+            format_time(max, hist_limit(top));
+            log_printf("Latency %s %s: %llu, mean %s, 50%% %s, 90%% %s, 99%% %s, max %s", command_names[c], phase_names[p], count, mean, q[0], q[1], q[2], max);
+        }
+    }
+}
+
+void metrics_error(Metric_error e) {
+    metrics_count(errors[e], 1);
+}
+
+void metrics_cache(int hit) {
+    if (hit) metrics_count(hits, 1); else metrics_count(misses, 1);
+}
+
+void metrics_channels(int n) {
+    if (session != NULL) metrics_set(session->channels, n);
+}
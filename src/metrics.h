@@ -0,0 +1,50 @@
+/*
+
+ metrics.h
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _METRICS_H
+#define _METRICS_H
+
+struct Driver;
+
+typedef enum Metric_command {
+    MC_NONE, MC_OPEN, MC_READ, MC_WRITE, MC_CLOSE, MC_STATUS, MC_COMMANDS
+} Metric_command;
+
+typedef enum Metric_phase {
+    MP_RECEIVE, MP_RESOLVE, MP_SCAN, MP_IO, MP_REPLY, MP_TOTAL, MP_PHASES
+} Metric_phase;
+
+typedef enum Metric_error {
+    ME_FRAME, ME_CRC, ME_TIMEOUT, ME_ERRORS
+} Metric_error;
+
+extern int metrics_open(const char *);
+extern void metrics_serve(void);
+extern void metrics_session(const char *);
+extern const struct Driver *metrics_driver(const struct Driver *);
+extern void metrics_begin(Metric_command, int);
+extern void metrics_end(int);
+extern void metrics_phase(Metric_phase);
+extern void metrics_dump(void);
+extern void metrics_error(Metric_error);
+extern void metrics_cache(int);
+extern void metrics_channels(int);
+#endif
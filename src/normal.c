@@ -31,6 +31,8 @@
 #include "arguments.h"
 #include "buffer.h"
 #include "ideservd.h"
+#include "metrics.h"
+#include "vfs.h"
 #ifdef __MINGW32__
 #define lstat stat
 #endif
@@ -42,10 +44,6 @@
 #include <unistd.h>
 #include <errno.h>
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
-
 static unsigned long long duration(const struct timeval *start) {
     struct timeval end;
     gettimeofday(&end, NULL);
@@ -53,7 +51,7 @@ static unsigned long long duration(const struct timeval *start) {
 }
 
 static inline int send_trailer(const Driver *driver, const Arguments *arguments, int usecrc) {
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (usecrc) {
             driver->sendb(crc_get());
         }
@@ -101,7 +99,7 @@ int statuserror(const Driver *driver, const char *errorbuff, const Arguments *ar
     }
     cmd[fp] = 0;
 
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (check_trailer(driver, "Status", usecrc)) return 1;
         if (r != 0) {
             seterror(ER_FRAME_ERROR, 1);
@@ -111,6 +109,7 @@ int statuserror(const Driver *driver, const char *errorbuff, const Arguments *ar
     } else {
         if (driver->done()) return 1;
     }
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) {
         gettimeofday(&start, NULL);
@@ -121,6 +120,7 @@ int statuserror(const Driver *driver, const char *errorbuff, const Arguments *ar
         log_hex(cmd);
     }
     commandchannel(cmd);
+    metrics_phase(MP_IO);
     if (arguments->verbose) {
         log_time("Status: Took", duration(&start));
     }
@@ -128,7 +128,7 @@ int statuserror(const Driver *driver, const char *errorbuff, const Arguments *ar
     crc_clear(0);
     fp = strlen(errorbuff);
     driver->sendb(fp);
-    if (arguments->mode == M_ETHERNET) driver->sendb(fp);
+    if (arguments->protocol == M_ETHERNET) driver->sendb(fp);
     driver->sendbytes((const unsigned char *)errorbuff, fp);
     return send_trailer(driver, arguments, usecrc) != 0;
 }
@@ -157,7 +157,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
     }
     cmd[fp] = 0;
 
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (check_trailer(driver, "Open", usecrc)) return 1;
         if (r != 0) {
             seterror(ER_FRAME_ERROR, 1);
@@ -167,6 +167,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
     } else {
         if (driver->done()) return 1;
     }
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) {
         gettimeofday(&start, NULL);
@@ -176,9 +177,8 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
         log_print("Open:");
         log_hex(cmd);
     }
-    if (buffer->file != NULL) {
-        fclose(buffer->file);
-        buffer->file = NULL;
+    if (buffer->file != NULL && buffer_close(buffer, arguments, 0)) {
+        log_printf("Open: Couldn't write: %s(%d)", strerror(errno), errno);
     }
     buffer->mode = CM_CLOSED;
     buffer->filepos = 0;
@@ -196,6 +196,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
         partition = !strncmp((char *)&cmd[1], "=P", 2);
 
         outname = resolv_path(cmd + 1, outpath, &outpart, arguments->nameconversion);
+        metrics_phase(MP_RESOLVE);
         if (arguments->verbose) log_printf("Open #%d: \"$%s\"", channel, outpath);
 
         if (channel == 1) {
@@ -207,7 +208,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
                 log_printf("Open: Couldn't open the directory \"%s\": %s(%d)", outpath, strerror(errno), errno);
                 goto vege;
             }
-            if (buffer_rawdir(buffer, directory)) {
+            if (buffer_rawdir(buffer, directory, outpart)) {
                 buffer->size &= ~511;
                 status = ER_READ_ERROR;
                 log_print("Open: Out of memory");
@@ -240,6 +241,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
                 status = errtochannel15(directory_close(directory));
             }
         }
+        metrics_phase(MP_SCAN);
         if ((buffer->size & 511) != 0) {
             unsigned int padding = (-buffer->size) & 511;
             if (buffer_reserve(buffer, buffer->size + padding)) {
@@ -254,6 +256,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
     } else {
         Petscii name[17], type[4]={'*',0};
         const Petscii *outname;
+        partition_t outpart = 0;
         unsigned char overwrite;
         char lname[1000], outpath[1020];
         int found = 0;
@@ -268,12 +271,13 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
             break;
         }
 
-        outname = resolv_path(cmd, outpath, NULL, arguments->nameconversion);
+        outname = resolv_path(cmd, outpath, &outpart, arguments->nameconversion);
         if (outname == NULL) {
             status = ER_PATH_NOT_FOUND; goto vege;
         }
         if (channel == 1) strcpy((char *)type, "PRG");
         convertfilename(outname, ',', name, type, &mode);
+        metrics_phase(MP_RESOLVE);
 
         directory = directory_open(outpath, arguments->nameconversion, 0);
         if (directory == NULL) {
@@ -284,15 +288,15 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
 
         while (directory_read(directory, &dirent))
         {
-            struct stat buf;
+            unsigned long size;
 
             if ((dirent.attrib & (A_ANY | A_CLOSED)) != (A_CLOSED | A_NORMAL)) continue;
 
             if (!matchname(dirent.name, name)) continue;
             if (!matchname(dirent.filetype, type)) continue;
 
-            if (lstat(directory_path(directory), &buf)) continue;
-            length = buf.st_size;
+            if (vfs_stat(directory_path(directory), &size)) continue;
+            length = size;
 
             strncpy(lname, directory_filename(directory), 999);
 
@@ -300,6 +304,7 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
             break;
         }
         directory_close(directory);
+        metrics_phase(MP_SCAN);
 
         if (!found) convertc64name(lname, name, type, arguments->nameconversion);
 
@@ -328,17 +333,19 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
 
             if (found && !overwrite) {
                 status = ER_FILE_EXISTS;
+            } else if (partition_get_readonly(outpart) || (found && vfs_stream(lname, strlen(lname)))) {
+                status = ER_WRITE_PROTECT_ON;
             } else {
-#ifndef WIN32
-                buffer->fd = open(outpath, O_CREAT | O_RDWR | (overwrite ? O_TRUNC : O_EXCL), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-#else
-                buffer->fd = open(outpath, O_CREAT | O_RDWR | (overwrite ? O_TRUNC : O_EXCL) | O_BINARY, S_IRUSR | S_IWUSR);
-#endif
-                if (buffer->fd < 0) status = errtochannel15(1); else {
+                if (found) {
+                    buffer->file = buffer_opentemp(buffer, outpath);
+                } else {
+                    buffer->file = vfs_fopenw(outpath, O_CREAT | O_RDWR | (overwrite ? O_TRUNC : O_EXCL), &buffer->fd);
+                }
+                if (buffer->file == NULL) status = errtochannel15(1); else {
                     status = ER_OK;
-                    buffer->file = fdopen(buffer->fd, "wb+");
                     buffer->mode = CM_FILE;
                     buffer->filesize = 0;
+                    buffer_writeinit(buffer, 0, arguments->prealloc, outpart);
                 }
             }
         } else {
@@ -346,33 +353,36 @@ int openfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
                 status = ER_FILE_NOT_FOUND;
             } else {
                 if (mode == 'R') {
-                    buffer->fd = open(outpath, O_RDONLY | O_BINARY, 0);
-                    if (buffer->fd < 0) status = errtochannel15(1); else {
+                    buffer->file = vfs_fopen(outpath, &buffer->fd);
+                    if (buffer->file == NULL) status = errtochannel15(1); else {
                         status = ER_OK;
-                        buffer->file = fdopen(buffer->fd, "rb");
                         buffer->mode = CM_FILE;
                         buffer->filesize = length;
+                        buffer_readinit(buffer, outpart);
                     }
                 }
-                if (mode == 'A' || mode == 'M') {
-                    buffer->fd = open(outpath, O_RDWR | O_BINARY, 0);
-                    if (buffer->fd < 0) status = errtochannel15(1); else {
+                if ((mode == 'A' || mode == 'M') && (partition_get_readonly(outpart) || vfs_stream(lname, strlen(lname)))) {
+                    status = ER_WRITE_PROTECT_ON;
+                } else if (mode == 'A' || mode == 'M') {
+                    buffer->file = vfs_fopenw(outpath, O_RDWR, &buffer->fd);
+                    if (buffer->file == NULL) status = errtochannel15(1); else {
                         status = ER_OK;
-                        buffer->file = fdopen(buffer->fd, "rb+");
                         buffer->mode = CM_FILE;
                         buffer->filesize = length;
+                        buffer_writeinit(buffer, 0, arguments->prealloc, outpart);
                     }
                 }
             }
         }
     }
 vege:
+    metrics_phase(MP_IO);
     if (arguments->verbose) {
         log_time((channel == 15) ? "Status: Took" : "Open: Took", duration(&start));
     }
     {
         unsigned char buf[6];
-        if (arguments->mode == M_ETHERNET) {
+        if (arguments->protocol == M_ETHERNET) {
             buf[0] = length;
             buf[1] = length >> 8;
             buf[2] = length >> 16;
@@ -398,18 +408,20 @@ int closefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
     unsigned char channel;
     unsigned int length;
     struct timeval start;
+    Errorcode status = ER_OK;
     Buffer *buffer;
     unsigned char buf[5];
 
     driver->getbytes(buf, sizeof buf);
     channel = buf[0] & 0x0f;
     length = (((((buf[4] << 8) | buf[3]) << 8) | buf[2]) << 8) | buf[1];
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (check_trailer(driver, "Close", usecrc)) return 1;
     } else {
         if (driver->done()) return 1;
     }
     buffer = &buff[channel];
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) {
         gettimeofday(&start, NULL);
@@ -420,30 +432,39 @@ int closefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
     else {
         if (buffer->file != NULL) {
             if (buffer->mode == CM_FILE && length >= buffer->filesize) {
+                buffer_writeback(buffer);
                 fflush(buffer->file);
-                if (ftruncate(buffer->fd, length)) {
+                if (vfs_ftruncate(buffer->file, buffer->fd, length)) {
                     log_printf("Close: Couldn't truncate: %s(%d)", strerror(errno), errno);
                 }
             }
-            fclose(buffer->file);
-            buffer->file = NULL;
+            if (buffer_close(buffer, arguments, 1)) {
+                log_printf("Close: Couldn't write: %s(%d)", strerror(errno), errno);
+                status = errtochannel15(1);
+                if (status == ER_OK) status = ER_WRITE_ERROR;
+            }
         }
         buffer->mode = CM_CLOSED;
-        if (buffer->data != NULL) {
-            buffer->capacity = 0;
-            free(buffer->data);
-            buffer->data = NULL;
-        }
+        buffer_release(buffer);
     }
+    metrics_phase(MP_IO);
     if (arguments->verbose) {
         log_time("Close: Took", duration(&start));
     }
     crc_clear(0);
-    driver->sendb(0x80 | ER_OK);
-    if (arguments->mode == M_ETHERNET) driver->sendb(0x80 | ER_OK);
+    driver->sendb(0x80 | status);
+    if (arguments->protocol == M_ETHERNET) driver->sendb(0x80 | status);
     return send_trailer(driver, arguments, usecrc) != 0;
 }
 
+static int listing(Buffer *buffer, size_t len) {
+    size_t end = buffer->pointer + len;
+    if (buffer->mode == CM_ERR) return buffer_reserve(buffer, end);
+    if (buffer->pointer > buffer->size || buffer_reserve(buffer, end)) return 1;
+    if (end > buffer->size) memset(buffer->data + buffer->size, 0, end - buffer->size);
+    return 0;
+}
+
 int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int flags) {
     int usecrc = flags & FLAG_USE_CRC;
     unsigned char channel, sectors;
@@ -452,20 +473,23 @@ int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
     unsigned int address;
     Buffer *buffer;
     unsigned char buf[5];
+    int burst = 0;
 
     driver->getbytes(buf, sizeof buf);
     channel = buf[0] & 0x0f;
     address = (((buf[3] << 8) | buf[2]) << 8) | buf[1];
     sectors = buf[4];
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (check_trailer(driver, "Read", usecrc)) return 1;
     } else {
+        burst = driver->getb(0) == 'B';
         if (driver->done()) return 1;
     }
     buffer = &buff[channel];
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) log_printf("Read #%d: %06x %d sector(s)", channel, address, sectors);
-    if (sectors > 128 || sectors == 0 || (arguments->mode == M_ETHERNET && sectors > 2)) {
+    if (sectors > 128 || sectors == 0 || (arguments->protocol == M_ETHERNET && sectors > 2 && !burst)) {
         log_print("Read: Invalid sector count");
         goto error;
     }
@@ -473,29 +497,38 @@ int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
         log_print((buffer->mode == CM_CLOSED) ? "Read: Channel not open" : "Read: Not readable");
         crc_clear(0);
         driver->sendb(0x80 | ER_NO_CHANNEL);
-        if (arguments->mode == M_ETHERNET) driver->sendb(0x80 | ER_NO_CHANNEL);
+        if (arguments->protocol == M_ETHERNET) driver->sendb(0x80 | ER_NO_CHANNEL);
         return send_trailer(driver, arguments, usecrc) != 0;
     }
 
     if (buffer->mode == CM_FILE) {
-        if (buffer_reserve(buffer, (arguments->mode == M_ETHERNET) ? sectors * 512 : 512)) {
+        if (buffer_reserve(buffer, (arguments->protocol == M_ETHERNET) ? sectors * 512 : 512)) {
             log_print("Read: Out of memory");
             goto error;
         }
+        if (buffer->wsize != 0) buffer_writeback(buffer);
+        if (buffer->written) {
+            fflush(buffer->file);
+            buffer->written = 0;
+            buffer->filepos = -1;
+        }
         if (buffer->filepos != address && fseek(buffer->file, address << 8, SEEK_SET)) {
             buffer->filepos = -1;
             log_printf("Read: Couldn't seek: %s(%d)", strerror(errno), errno);
         error:
             crc_clear(0);
             driver->sendb(0x80 | ER_READ_ERROR);
-            if (arguments->mode == M_ETHERNET) driver->sendb(0x80 | ER_READ_ERROR);
+            if (arguments->protocol == M_ETHERNET) driver->sendb(0x80 | ER_READ_ERROR);
             return send_trailer(driver, arguments, usecrc) != 0;
         }
         buffer->filepos = address;
         clearerr(buffer->file);
+    } else if (listing(buffer, sectors * 512)) {
+        log_print("Read: Beyond end of listing");
+        goto error;
     }
 
-    if (arguments->mode == M_ETHERNET) {
+    if (arguments->protocol == M_ETHERNET) {
         const unsigned char *data;
         if (buffer->mode == CM_FILE) {
             size_t itt = fread(buffer->data, 1, sectors * 512, buffer->file);
@@ -509,18 +542,31 @@ int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
             }
             if (itt < sectors * 512) memset(buffer->data + itt, 0, sectors * 512 - itt);
             data = buffer->data;
+            metrics_phase(MP_IO);
         } else {
             data = buffer->data + buffer->pointer;
         }
-        driver->sendbytes(data, sectors * 512);
-        driver->sendb(0x80 | ER_OK);
-        driver->sendb(0x80 | ER_OK);
-        if (send_trailer(driver, arguments, usecrc)) return 1;
+        if (burst) {
+            unsigned int i, fragments = (sectors + 1) >> 1;
+            for (i = 0; i < fragments; i++) {
+                driver->sendb(i);
+                driver->sendb(fragments);
+                driver->sendbytes(data + i * 1024, (i * 2 + 1 < sectors) ? 1024 : 512);
+                driver->sendb(0x80 | ER_OK);
+                driver->sendb(0x80 | ER_OK);
+                if (send_trailer(driver, arguments, usecrc)) return 1;
+            }
+        } else {
+            driver->sendbytes(data, sectors * 512);
+            driver->sendb(0x80 | ER_OK);
+            driver->sendb(0x80 | ER_OK);
+            if (send_trailer(driver, arguments, usecrc)) return 1;
+        }
         buffer->pointer += sectors * 512;
     } else {
         crc_clear(0);
         driver->sendb(0x80 | ER_OK);
-        if (arguments->mode == M_RS232 || arguments->mode == M_RS232S) {
+        if (arguments->protocol == M_RS232 || arguments->protocol == M_RS232S) {
             if (send_trailer(driver, arguments, usecrc)) return 1;
         } else {
             if (usecrc) {
@@ -544,10 +590,11 @@ int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
                 }
                 if (itt < 512) memset(buffer->data + itt, 0, 512 - itt);
                 data = buffer->data;
+                metrics_phase(MP_IO);
             } else {
                 data = buffer->data + buffer->pointer;
             }
-            if (arguments->mode == M_RS232 || arguments->mode == M_RS232S) {
+            if (arguments->protocol == M_RS232 || arguments->protocol == M_RS232S) {
                 int fr = driver->getb(1);
                 if (driver->done()) return 1;
                 if (fr != 0x5a) {
@@ -555,11 +602,12 @@ int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
                     log_print("Read: Frame error");
                     return 1;
                 }
+                metrics_phase(MP_RECEIVE);
             }
             crc_clear(0);
             driver->sendbytes(data, 512);
             driver->sendb(err ? 0x80 | ER_READ_ERROR : 0x80 | ER_OK);
-            if (arguments->mode == M_RS232 || arguments->mode == M_RS232S) {
+            if (arguments->protocol == M_RS232 || arguments->protocol == M_RS232S) {
                 if (send_trailer(driver, arguments, usecrc)) return 1;
             } else {
                 if (usecrc) {
@@ -567,11 +615,12 @@ int readfile(const Driver *driver, Buffer *buff, const Arguments *arguments, int
                 }
                 driver->sendb(0x5a);
             }
+            metrics_phase(MP_REPLY);
             if (err) break;
             buffer->pointer += 512;
             sectors--; l += 512;
         }
-        if (arguments->mode != M_RS232 && arguments->mode != M_RS232S) {
+        if (arguments->protocol != M_RS232 && arguments->protocol != M_RS232S) {
             if (driver->flush()) return 1;
         }
         if (arguments->verbose) {
@@ -588,6 +637,7 @@ int writefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
     struct timeval start;
     unsigned int l = 0;
     unsigned int address;
+    unsigned long offset;
     Buffer *buffer;
     int fr;
     unsigned char buf[5];
@@ -596,15 +646,16 @@ int writefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
     channel = buf[0] & 0x0f;
     address = (((buf[3] << 8) | buf[2]) << 8) | buf[1];
     sectors = buf[4];
-    if (arguments->mode != M_ETHERNET) {
+    if (arguments->protocol != M_ETHERNET) {
         if (check_trailer(driver, "Write", usecrc)) return 1;
     } else {
         if (driver->done()) return 1;
     }
     buffer = &buff[channel];
+    metrics_phase(MP_RECEIVE);
 
     if (arguments->verbose) log_printf("Write #%d: %06x %d sector(s)", channel, address, sectors);
-    if (sectors > 128 || sectors == 0 || (arguments->mode == M_ETHERNET && sectors > 2)) {
+    if (sectors > 128 || sectors == 0 || (arguments->protocol == M_ETHERNET && sectors > 2)) {
         log_print("Write: Invalid sector count");
         goto error;
     }
@@ -613,30 +664,28 @@ int writefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
     error:
         crc_clear(0);
         driver->sendb(0x80 | ER_WRITE_ERROR);
-        if (arguments->mode == M_ETHERNET) driver->sendb(0x80 | ER_WRITE_ERROR);
+        if (arguments->protocol == M_ETHERNET) driver->sendb(0x80 | ER_WRITE_ERROR);
         return send_trailer(driver, arguments, usecrc) != 0;
     }
 
-    if (buffer_reserve(buffer, (arguments->mode == M_ETHERNET) ? 512 * sectors : 514)) {
+    if (buffer_reserve(buffer, (arguments->protocol == M_ETHERNET) ? 512 * sectors : 514)) {
         log_print("Write: Out of memory");
         goto error;
     }
-    if (buffer->filepos != address && fseek(buffer->file, address << 8, SEEK_SET)) {
-        buffer->filepos = -1;
-        log_printf("Write: Couldn't seek: %s(%d)", strerror(errno), errno);
-        goto error;
-    }
-    buffer->filepos = address;
-    if (arguments->mode == M_ETHERNET) {
+    buffer->filepos = -1;
+    offset = (unsigned long)address << 8;
+    if (arguments->protocol == M_ETHERNET) {
+        int ok;
         driver->getbytes(buffer->data, 512 * sectors);
         if (driver->done()) return 1;
-        if (fwrite(buffer->data, 1, 512 * sectors, buffer->file) == 512 * sectors && fflush(buffer->file) == 0) {
-            buffer->filepos += sectors * 2;
+        metrics_phase(MP_RECEIVE);
+        ok = buffer_write(buffer, offset, buffer->data, 512 * sectors) == 0 && buffer_sync(buffer, arguments, 0) == 0;
+        metrics_phase(MP_IO);
+        if (ok) {
             driver->sendb(0x80 | ER_OK);
             driver->sendb(0x80 | ER_OK);
         } else {
-            buffer->filepos = -1;
-            log_printf("Write: Couldn't write: %s(%d)", strerror(errno), errno);
+            log_printf("Write: Couldn't write: %s(%d)", strerror(buffer->werror), buffer->werror);
             driver->sendb(0x80 | ER_WRITE_ERROR);
             driver->sendb(0x80 | ER_WRITE_ERROR);
         }
@@ -647,6 +696,7 @@ int writefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
         driver->turn();
         driver->sendb(0x80 | ER_OK);
         if (send_trailer(driver, arguments, usecrc)) return 1;
+        metrics_phase(MP_REPLY);
         if (arguments->verbose) {
             gettimeofday(&start, NULL);
         }
@@ -671,20 +721,22 @@ int writefile(const Driver *driver, Buffer *buff, const Arguments *arguments, in
                 log_print("Write: CRC error");
                 return 1;
             }
-            if (err == 0 && fwrite(buffer->data, 1, 512, buffer->file) != 512) err = errno;
-            buffer->filepos += 2;
+            metrics_phase(MP_RECEIVE);
+            if (err == 0 && buffer_write(buffer, offset, buffer->data, 512)) err = buffer->werror;
+            offset += 512;
             sectors--; l += 512;
-            if (sectors == 0 || arguments->mode == M_RS232 || arguments->mode == M_RS232S) {
-                if (err == 0 && fflush(buffer->file) != 0) err = errno;
+            if (sectors == 0 || arguments->protocol == M_RS232 || arguments->protocol == M_RS232S) {
+                if (err == 0 && buffer_sync(buffer, arguments, 0)) err = buffer->werror;
                 if (err != 0) {
-                    buffer->filepos = -1;
                     log_printf("Write: Couldn't write: %s(%d)", strerror(err), err);
                 }
+                metrics_phase(MP_IO);
                 crc_clear(0);
                 driver->sendb(err ? 0x80 | ER_WRITE_ERROR : 0x80 | ER_OK);
                 if (send_trailer(driver, arguments, usecrc)) return 1;
+                metrics_phase(MP_REPLY);
                 if (err) break;
-            }
+            } else metrics_phase(MP_IO);
         }
         if (arguments->verbose) {
             log_speed("Write: Received", l, duration(&start));
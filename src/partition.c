@@ -25,6 +25,13 @@
 #include "partition.h"
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include "message.h"
+#include "vfs.h"
+#include "image.h"
+#include "archive.h"
+#include "ram.h"
 
 static partition_t work_partition;
 static char null_path;
@@ -32,11 +39,17 @@ static char null_path;
 typedef struct Partition {
     Petscii name[17];
     char *path;
+    const char *root;
+    int readonly;
+    Cachemode cache;
+    int sync;
+    Syncmode syncmode;
+    unsigned int syncinterval;
 } Partition;
 
 Partition partitions[256];
 
-void partition_create(partition_t n, const Petscii *name) {
+void partition_create(partition_t n, const Petscii *name, const char *root) {
     Partition *p = &partitions[n];
     unsigned int i;
 
@@ -44,7 +57,126 @@ void partition_create(partition_t n, const Petscii *name) {
         p->name[i] = name[i];
     }
     p->name[i] = 0;
+    p->root = root;
+    p->readonly = 0;
+    p->cache = CACHE_NORMAL;
+    p->sync = 0;
     p->path = &null_path;
+    partition_set_path(n, root);
+}
+
+static char *token(char **line) {
+    char *s = *line, *start;
+
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == 0 || *s == '#') return NULL;
+    if (*s == '"') {
+        start = ++s;
+        while (*s != 0 && *s != '"') s++;
+    } else {
+        start = s;
+        while (*s != 0 && *s != ' ' && *s != '\t') s++;
+    }
+    if (*s != 0) *s++ = 0;
+    *line = s;
+    return start;
+}
+
+static const char *partition_parse(char *line, const char **what) {
+    char *number, *name, *backend, *root, *option, *end;
+    const char *path;
+    Petscii pname[17];
+    unsigned long n, size;
+    unsigned int i;
+    Partition *p;
+    int readonly = 0, sync = 0;
+    Cachemode cache = CACHE_NORMAL;
+    Syncmode syncmode = SYNC_NONE;
+    unsigned int syncinterval = 0;
+
+    number = token(&line);
+    if (number == NULL) return NULL;
+    *what = number;
+    n = strtoul(number, &end, 10);
+    if (*end != 0 || n < 1 || n > 254) return "Invalid partition number";
+    name = token(&line);
+    backend = token(&line);
+    root = token(&line);
+    if (root == NULL) return "Missing name, backend or root";
+
+    while ((option = token(&line)) != NULL) {
+        *what = option;
+        if (!strcmp(option, "readonly")) readonly = 1;
+        else if (!strcmp(option, "cache=normal")) cache = CACHE_NORMAL;
+        else if (!strcmp(option, "cache=ahead")) cache = CACHE_AHEAD;
+        else if (!strcmp(option, "cache=none")) cache = CACHE_NONE;
+        else if (!strncmp(option, "sync=", 5) && !arguments_sync(option + 5, &syncmode, &syncinterval)) sync = 1;
+        else return "Unknown option";
+    }
+
+    *what = root;
+    if (!strcmp(backend, "ram")) {
+        if (arguments_size(root, &size)) return "Invalid RAM disk size";
+        path = ram_create(size);
+    } else {
+        if (!strcmp(backend, "native")) {
+            for (;;) {
+                if (root[0] == '/') root++;
+                else if (root[0] == '.' && root[1] == '/') root += 2;
+                else break;
+            }
+            if (root[0] == '.' && root[1] == 0) root++;
+            for (i = strlen(root); i != 0 && root[i - 1] == '/'; i--) root[i - 1] = 0;
+            if (vfs_container(root)) return "Not a directory";
+        } else if (!strcmp(backend, "image")) {
+            if (!vfs_container(root) || !image_backend()->probe(root, strlen(root))) return "Not a disk image";
+            readonly = 1;
+        } else if (!strcmp(backend, "archive")) {
+            if (!vfs_container(root) || !archive_backend()->probe(root, strlen(root))) return "Not an archive";
+            readonly = 1;
+        } else {
+            *what = backend;
+            return "Unknown backend";
+        }
+        path = strdup(root);
+    }
+    if (path == NULL) return strerror(errno);
+
+    for (i = 0; name[i] != 0 && i < sizeof pname - 1; i++) {
+        pname[i] = (name[i] >= 'a' && name[i] <= 'z') ? name[i] - 0x20 : name[i];
+    }
+    pname[i] = 0;
+    partition_create(n, pname, path);
+    p = &partitions[n];
+    p->readonly = readonly;
+    p->cache = cache;
+    p->sync = sync;
+    p->syncmode = syncmode;
+    p->syncinterval = syncinterval;
+    return NULL;
+}
+
+int partition_load(const char *filename) {
+    char line[1024];
+    unsigned int number = 0;
+    FILE *f = fopen(filename, "rt");
+
+    if (f == NULL) {
+        message("Couldn't open the partition map \"%s\": %s(%d)\n", filename, strerror(errno), errno);
+        return -1;
+    }
+    while (fgets(line, sizeof line, f) != NULL) {
+        const char *what = NULL, *err;
+        number++;
+        line[strcspn(line, "\r\n")] = 0;
+        err = partition_parse(line, &what);
+        if (err == NULL) continue;
+        message("%s:%u: %s \"%s\"\n", filename, number, err, what);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
 }
 
 int partition_select(partition_t n) {
@@ -59,10 +191,32 @@ char *partition_get_path(partition_t n) {
     return partitions[n ? n : work_partition].path;
 }
 
+const char *partition_get_root(partition_t n) {
+    const Partition *p = &partitions[n ? n : work_partition];
+
+    return (p->path != NULL) ? p->root : NULL;
+}
+
 partition_t partition_get_current(void) {
     return work_partition;
 }
 
+int partition_get_readonly(partition_t n) {
+    return partitions[n ? n : work_partition].readonly;
+}
+
+Cachemode partition_get_cache(partition_t n) {
+    return partitions[n ? n : work_partition].cache;
+}
+
+void partition_get_sync(partition_t n, Syncmode *syncmode, unsigned int *syncinterval) {
+    const Partition *p = &partitions[n ? n : work_partition];
+
+    if (!p->sync) return;
+    *syncmode = p->syncmode;
+    *syncinterval = p->syncinterval;
+}
+
 const Petscii *partition_get_name(partition_t n) {
     const Partition *p = &partitions[n ? n : work_partition];
 
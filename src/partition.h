@@ -24,14 +24,24 @@
 */
 #ifndef _PARTITION_H
 #define _PARTITION_H
+#include "arguments.h"
 
 typedef unsigned char partition_t;
 typedef unsigned char Petscii;
 
-extern void partition_create(partition_t, const Petscii *);
+typedef enum Cachemode {
+    CACHE_NORMAL, CACHE_AHEAD, CACHE_NONE
+} Cachemode;
+
+extern void partition_create(partition_t, const Petscii *, const char *);
+extern int partition_load(const char *);
 extern int partition_select(partition_t);
 extern char *partition_get_path(partition_t);
+extern const char *partition_get_root(partition_t);
 extern const Petscii *partition_get_name(partition_t);
 extern partition_t partition_get_current(void);
+extern int partition_get_readonly(partition_t);
+extern Cachemode partition_get_cache(partition_t);
+extern void partition_get_sync(partition_t, Syncmode *, unsigned int *);
 extern void partition_set_path(partition_t, const char *);
 #endif
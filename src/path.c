@@ -43,6 +43,8 @@
 #include "shorten.h"
 #include "log.h"
 #include "ideservd.h"
+#include "vfs.h"
+#include "ram.h"
 
 static const unsigned char latinconv1[] = {
     0xc1, 0xc1, 0xc1, 0xc1, 0xc1, 0xc1, 0xa4, 0xc3, 0xc5, 0xc5, 0xc5, 0xc5, 0xc9,
@@ -297,6 +299,9 @@ typedef struct Accesscache {
 
 struct Directory {
     DIR *dir;
+    Vfs_dir *vdir;
+    Ram_dir *rdir;
+    int raw;
     char path[2020];
     char *filename;
     Nameconversion nameconversion;
@@ -328,8 +333,17 @@ Directory *directory_open(const char *path, Nameconversion nameconversion, int m
         return NULL;
     }
     len = strlen(path);
-    dir = opendir(len != 0 ? path : ".");
-    if (dir == NULL) {
+    directory->vdir = NULL;
+    directory->rdir = NULL;
+    directory->raw = 0;
+    if (ram_path(path)) {
+        dir = NULL;
+        directory->rdir = ram_opendir(path);
+    } else {
+        dir = opendir(len != 0 ? path : ".");
+        if (dir == NULL && errno == ENOTDIR) directory->vdir = vfs_opendir(path);
+    }
+    if (dir == NULL && directory->vdir == NULL && directory->rdir == NULL) {
         free(directory);
         return NULL;
     }
@@ -350,7 +364,13 @@ int directory_close(Directory *directory) {
     avltree_destroy(&directory->filenames, filename_free);
     free(lastfn);
     lastfn = NULL;
-    ret = closedir(directory->dir);
+    if (directory->vdir != NULL) {
+        vfs_closedir(directory->vdir);
+        ret = 0;
+    } else if (directory->rdir != NULL) {
+        ram_closedir(directory->rdir);
+        ret = 0;
+    } else ret = closedir(directory->dir);
     free(directory);
     return ret;
 }
@@ -370,29 +390,57 @@ int directory_read(Directory *directory, Directory_entry *kesz) {
     const struct dirent *ep;
     struct avltree_node *b;
     struct stat buf;
-    int stated;
+    int stated, readonly;
+    char stripped[1000];
 
-    while ((ep = readdir(directory->dir))) {
-        const char *filename = ep->d_name;
+    for (;;) {
+        const char *filename;
         char *dst;
-        size_t fnlen;
-
-        if (filename[0] == '.' && (filename[1] == 0 || (filename[1] == '.' && filename[2] == 0))) continue;
+        size_t fnlen, l;
+        int raw = directory->raw;
+
+        if (raw) {
+            directory->raw = 0;
+            filename = directory->filename + (directory->path != directory->filename);
+            buf.st_mode = S_IFREG;
+        } else if (directory->vdir != NULL || directory->rdir != NULL) {
+            int isdir;
+            unsigned long size;
+            time_t time;
+            if (directory->vdir != NULL) {
+                filename = vfs_readdir(directory->vdir, &isdir, &size, &time);
+            } else {
+                filename = ram_readdir(directory->rdir, &isdir, &size, &time);
+                if (filename != NULL && !strncmp(filename, TEMPFILE_PREFIX, sizeof TEMPFILE_PREFIX - 1)) continue;
+            }
+            if (filename == NULL) break;
+            buf.st_mode = isdir ? S_IFDIR : S_IFREG;
+            kesz->size = size;
+            kesz->time = time;
+        } else {
+            ep = readdir(directory->dir);
+            if (ep == NULL) break;
+            filename = ep->d_name;
+            if (filename[0] == '.' && (filename[1] == 0 || (filename[1] == '.' && filename[2] == 0))) continue;
+            if (!strncmp(filename, TEMPFILE_PREFIX, sizeof TEMPFILE_PREFIX - 1)) continue;
 
 #ifdef __MINGW32__
-        buf.st_mode = 0;
+            buf.st_mode = 0;
 #else
-        buf.st_mode = (ep->d_type == DT_UNKNOWN) ? 0 : DTTOIF(ep->d_type);
+            buf.st_mode = (ep->d_type == DT_UNKNOWN) ? 0 : DTTOIF(ep->d_type);
 #endif
+        }
 
         fnlen = strlen(filename);
         if (fnlen > 999) continue;
 
         dst = directory->filename;
         if (directory->path != dst) *dst++ = '/';
-        memcpy(dst, filename, fnlen + 1);
+        memmove(dst, filename, fnlen + 1);
 
-        if ((directory->mode == 0 && buf.st_mode != 0) || (directory->mode < 3 && S_ISDIR(buf.st_mode))) {
+        if (directory->vdir != NULL || directory->rdir != NULL) {
+            stated = 0;
+        } else if ((directory->mode == 0 && buf.st_mode != 0) || (directory->mode < 3 && S_ISDIR(buf.st_mode))) {
             kesz->size = 0;
             kesz->time = 0;
             stated = 0;
@@ -402,6 +450,21 @@ int directory_read(Directory *directory, Directory_entry *kesz) {
             kesz->time = buf.st_mtime;
             stated = 1;
         }
+        readonly = (directory->vdir != NULL);
+        if (!raw && !readonly && directory->rdir == NULL && S_ISREG(buf.st_mode)) {
+            if (vfs_container(filename)) {
+                buf.st_mode = S_IFDIR;
+                readonly = 1;
+                directory->raw = 1;
+            } else if ((l = vfs_stream(filename, fnlen)) != 0) {
+                unsigned long size;
+                if (stated && !vfs_stat(directory->path, &size)) kesz->size = size;
+                memcpy(stripped, filename, l);
+                stripped[l] = 0;
+                filename = stripped;
+                fnlen = l;
+            }
+        }
 
         memset(kesz->name, 0, 17);
         if (directory->nameconversion == NC_IGNOREDOT) {
@@ -410,7 +473,12 @@ int directory_read(Directory *directory, Directory_entry *kesz) {
             memset(kesz->filetype, 0, 4);
         }
         kesz->attrib = A_DELETEABLE;
-        if (directory->mode > 2) {
+        if (readonly) {
+            kesz->attrib = (directory->mode > 2) ? (A_READABLE | A_EXECUTEABLE) : 0;
+        } else if (directory->rdir != NULL) {
+            if (directory->mode > 2) kesz->attrib |= A_READABLE | A_EXECUTEABLE;
+            if (directory->mode > 1) kesz->attrib |= A_WRITEABLE;
+        } else if (directory->mode > 2) {
             if (!stated) {
                 if (!access(directory->path, X_OK)) {
                     kesz->attrib |= A_EXECUTEABLE;
@@ -433,7 +501,7 @@ int directory_read(Directory *directory, Directory_entry *kesz) {
                 }
             }
         }
-        if (directory->mode > 1) {
+        if (!readonly && directory->rdir == NULL && directory->mode > 1) {
             if (!stated) {
                 if (!access(directory->path, W_OK)) {
                     kesz->attrib |= A_WRITEABLE;
@@ -727,6 +795,14 @@ int matchname(Petscii *a, Petscii *b) {
     return 0;
 }
 
+void path_parent(char *path, unsigned char partition) {
+    const char *root = partition_get_root(partition);
+    size_t len = (root != NULL && !strncmp(path, root, strlen(root))) ? strlen(root) : 0;
+    char *o = strrchr(path + len, '/');
+    if (o == NULL) o = path + len;
+    *o = 0;
+}
+
 const Petscii *resolv_path(const Petscii *s, char *outpath, unsigned char *outpart, Nameconversion nameconversion) {
     Petscii name[17];
     int fel = 0, fel2 = 0;
@@ -741,10 +817,8 @@ const Petscii *resolv_path(const Petscii *s, char *outpath, unsigned char *outpa
         fel++;
     }
 
-    if (s[fel] == '/') {
-        outpath[0] = 0;
-    } else {
-        const char *path = partition_get_path(partition);
+    {
+        const char *path = (s[fel] == '/') ? partition_get_root(partition) : partition_get_path(partition);
         if (path == NULL) {
             return NULL;
         }
@@ -775,9 +849,7 @@ const Petscii *resolv_path(const Petscii *s, char *outpath, unsigned char *outpa
                 fel += 2; continue;
             }
             if (s[fel + 1] == '.' && fel2 == fel + 2) {
-                char *o = strrchr(outpath, '/');
-                if (o == NULL) o = outpath;
-                *o = 0;
+                path_parent(outpath, partition);
                 fel += 3; continue;
             }
         }
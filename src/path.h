@@ -28,6 +28,8 @@
 #include <time.h>
 #include "nameconversion.h"
 
+#define TEMPFILE_PREFIX ".ideservd-"
+
 typedef unsigned char Petscii;
 
 typedef struct Directory_entry {
@@ -64,6 +66,7 @@ extern const char *directory_filename(const Directory *);
 extern int directory_close(Directory *);
 extern void convertfilename(const Petscii *, char, Petscii *, Petscii *, unsigned char *);
 extern int matchname(Petscii *, Petscii *);
+extern void path_parent(char *, unsigned char);
 extern const Petscii *resolv_path(const Petscii *, char *, unsigned char *, Nameconversion);
 extern size_t c64toascii(char *, Petscii, mbstate_t *);
 extern void convertc64name(char *, const Petscii *, const Petscii *, Nameconversion);
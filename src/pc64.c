@@ -298,6 +298,12 @@ static void sendbytes(const unsigned char data[], unsigned int bytes) {
     }
 }
 
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    while (bytes > 0) {
+        driverp->sendb(data[--bytes]);
+    }
+}
+
 static void eshutdown(void) {
     parport_deinit();
     timeout_deinit();
@@ -371,6 +377,7 @@ static Driver driver = {
     .sendb        = sendb,
     .getbytes     = getbytes,
     .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
     .shutdown     = eshutdown,
     .flush        = flush,
     .done         = done,
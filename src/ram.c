@@ -0,0 +1,650 @@
+/*
+
+ ram.c - In-memory RAM disk partition
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#define _GNU_SOURCE
+#include "ram.h"
+#include "vfs.h"
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef VFS
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define RAM_EXTENT 4096
+#define RAM_ARENA (1 << 20)
+
+struct Ram_disk;
+
+typedef struct Ram_node {
+    char *name;
+    int dir;
+    struct Ram_node *parent, *child, *last, *prev, *next;
+    unsigned long size;
+    time_t time;
+    unsigned char **extents;
+    unsigned long extentcount;
+    unsigned int refs;
+    struct Ram_disk *disk;
+} Ram_node;
+
+typedef struct Ram_disk {
+    Ram_node *root;
+    unsigned long limit, used;
+    char path[sizeof RAM_ROOT + 10];
+} Ram_disk;
+
+struct Ram_dir {
+    Ram_node **nodes;
+    unsigned int count, next;
+};
+
+typedef struct Ram_file {
+    Ram_node *node;
+    unsigned long pos;
+    FILE *stream;
+    struct Ram_file *next;
+} Ram_file;
+
+static Ram_disk **disks;
+static unsigned int diskcount;
+static Ram_file *files;
+static unsigned char *arena, *freelist;
+static size_t arenaleft;
+
+static unsigned char *extent_new(Ram_disk *d) {
+    unsigned char *e;
+    if (d->used + RAM_EXTENT > d->limit) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    if (freelist != NULL) {
+        e = freelist;
+        memcpy(&freelist, e, sizeof freelist);
+    } else {
+        if (arenaleft < RAM_EXTENT) {
+            arena = (unsigned char *)malloc(RAM_ARENA);
+            if (arena == NULL) {
+                arenaleft = 0;
+                errno = ENOSPC;
+                return NULL;
+            }
+            arenaleft = RAM_ARENA;
+        }
+        e = arena;
+        arena += RAM_EXTENT;
+        arenaleft -= RAM_EXTENT;
+    }
+    d->used += RAM_EXTENT;
+    memset(e, 0, RAM_EXTENT);
+    return e;
+}
+
+static void extent_free(Ram_disk *d, unsigned char *e) {
+    memcpy(e, &freelist, sizeof freelist);
+    freelist = e;
+    d->used -= RAM_EXTENT;
+}
+
+static int grow(Ram_node *n, unsigned long count) {
+    unsigned char **extents;
+    unsigned long capacity = n->extentcount * 2;
+    if (capacity < 16) capacity = 16;
+    if (capacity < count) capacity = count;
+    extents = (unsigned char **)realloc(n->extents, capacity * sizeof *extents);
+    if (extents == NULL) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memset(extents + n->extentcount, 0, (capacity - n->extentcount) * sizeof *extents);
+    n->extents = extents;
+    n->extentcount = capacity;
+    return 0;
+}
+
+static void truncate_node(Ram_node *n, unsigned long size) {
+    unsigned long i;
+    for (i = (size + RAM_EXTENT - 1) / RAM_EXTENT; i < n->extentcount; i++) {
+        if (n->extents[i] == NULL) continue;
+        extent_free(n->disk, n->extents[i]);
+        n->extents[i] = NULL;
+    }
+    i = size / RAM_EXTENT;
+    if (size < n->size && i < n->extentcount && n->extents[i] != NULL) {
+        memset(n->extents[i] + size % RAM_EXTENT, 0, RAM_EXTENT - size % RAM_EXTENT);
+    }
+    n->size = size;
+    n->time = time(NULL);
+}
+
+static void node_put(Ram_node *n) {
+    if (--n->refs != 0) return;
+    truncate_node(n, 0);
+    free(n->extents);
+    free(n->name);
+    free(n);
+}
+
+static void attach(Ram_node *p, Ram_node *n) {
+    n->parent = p;
+    n->prev = p->last;
+    n->next = NULL;
+    if (p->last != NULL) p->last->next = n; else p->child = n;
+    p->last = n;
+}
+
+static void detach(Ram_node *n) {
+    Ram_node *p = n->parent;
+    if (n->prev != NULL) n->prev->next = n->next; else p->child = n->next;
+    if (n->next != NULL) n->next->prev = n->prev; else p->last = n->prev;
+    n->parent = n->prev = n->next = NULL;
+}
+
+static Ram_node *node_new(Ram_node *p, const char *name, int dir) {
+    Ram_node *n = (Ram_node *)calloc(1, sizeof *n);
+    if (n == NULL) return NULL;
+    n->name = strdup(name);
+    if (n->name == NULL) {
+        free(n);
+        return NULL;
+    }
+    n->dir = dir;
+    n->time = time(NULL);
+    n->refs = 1;
+    n->disk = p->disk;
+    attach(p, n);
+    return n;
+}
+
+static Ram_disk *lookup_disk(const char *path, size_t *skip) {
+    size_t i = sizeof RAM_ROOT - 1;
+    unsigned int d = 0;
+    if (strncmp(path, RAM_ROOT, i) || path[i] < '0' || path[i] > '9') return NULL;
+    while (path[i] >= '0' && path[i] <= '9' && d < diskcount) d = d * 10 + (path[i++] - '0');
+    if (d >= diskcount || (path[i] != 0 && path[i] != '/')) return NULL;
+    *skip = i;
+    return disks[d];
+}
+
+static Ram_node *find(const char *path, size_t len) {
+    Ram_node *n;
+    size_t i;
+    const Ram_disk *d = lookup_disk(path, &i);
+    if (d == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    n = d->root;
+    while (i < len) {
+        Ram_node *c;
+        size_t j;
+        if (path[i] == '/') {
+            i++;
+            continue;
+        }
+        if (!n->dir) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+        for (j = i; j < len && path[j] != '/'; j++);
+        for (c = n->child; c != NULL; c = c->next) {
+            if (!strncmp(c->name, path + i, j - i) && c->name[j - i] == 0) break;
+        }
+        if (c == NULL) {
+            errno = ENOENT;
+            return NULL;
+        }
+        n = c;
+        i = j;
+    }
+    return n;
+}
+
+static Ram_node *lookup(const char *path) {
+    return find(path, strlen(path));
+}
+
+static Ram_node *parent(const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    size_t skip;
+    Ram_node *p;
+    if (lookup_disk(path, &skip) == NULL || slash < path + skip || slash[1] == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    p = find(path, slash - path);
+    if (p == NULL) return NULL;
+    if (!p->dir) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    *name = slash + 1;
+    return p;
+}
+
+const char *ram_create(unsigned long size) {
+    Ram_disk *d, **list = (Ram_disk **)realloc(disks, (diskcount + 1) * sizeof *list);
+    if (list == NULL) return NULL;
+    disks = list;
+    d = (Ram_disk *)calloc(1, sizeof *d);
+    if (d == NULL) return NULL;
+    d->root = (Ram_node *)calloc(1, sizeof *d->root);
+    if (d->root == NULL) {
+        free(d);
+        return NULL;
+    }
+    d->root->dir = 1;
+    d->root->time = time(NULL);
+    d->root->refs = 1;
+    d->root->disk = d;
+    d->limit = size;
+    sprintf(d->path, RAM_ROOT "%u", diskcount);
+    disks[diskcount++] = d;
+    return d->path;
+}
+
+int ram_path(const char *path) {
+    size_t skip;
+    return lookup_disk(path, &skip) != NULL;
+}
+
+Ram_dir *ram_opendir(const char *path) {
+    Ram_dir *dir;
+    Ram_node *c, *n = lookup(path);
+    if (n == NULL) return NULL;
+    if (!n->dir) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    dir = (Ram_dir *)malloc(sizeof *dir);
+    if (dir == NULL) return NULL;
+    dir->count = dir->next = 0;
+    for (c = n->child; c != NULL; c = c->next) dir->count++;
+    dir->nodes = (Ram_node **)malloc((dir->count + 1) * sizeof *dir->nodes);
+    if (dir->nodes == NULL) {
+        free(dir);
+        return NULL;
+    }
+    dir->count = 0;
+    for (c = n->child; c != NULL; c = c->next) {
+        c->refs++;
+        dir->nodes[dir->count++] = c;
+    }
+    return dir;
+}
+
+const char *ram_readdir(Ram_dir *dir, int *isdir, unsigned long *size, time_t *time) {
+    while (dir->next < dir->count) {
+        const Ram_node *n = dir->nodes[dir->next++];
+        if (n->parent == NULL) continue;
+        *isdir = n->dir;
+        *size = n->size;
+        *time = n->time;
+        return n->name;
+    }
+    return NULL;
+}
+
+void ram_closedir(Ram_dir *dir) {
+    while (dir->count != 0) node_put(dir->nodes[--dir->count]);
+    free(dir->nodes);
+    free(dir);
+}
+
+int ram_stat(const char *path, unsigned long *size) {
+    const Ram_node *n = lookup(path);
+    if (n == NULL) return -1;
+    if (n->dir) {
+        errno = EISDIR;
+        return -1;
+    }
+    *size = n->size;
+    return 0;
+}
+
+static size_t file_read(Ram_file *f, char *buf, size_t size) {
+    const Ram_node *n = f->node;
+    size_t done = 0;
+    if (f->pos >= n->size) return 0;
+    if (size > n->size - f->pos) size = n->size - f->pos;
+    while (done < size) {
+        unsigned long i = f->pos / RAM_EXTENT, o = f->pos % RAM_EXTENT;
+        size_t l = RAM_EXTENT - o;
+        if (l > size - done) l = size - done;
+        if (i < n->extentcount && n->extents[i] != NULL) {
+            memcpy(buf + done, n->extents[i] + o, l);
+        } else {
+            memset(buf + done, 0, l);
+        }
+        done += l;
+        f->pos += l;
+    }
+    return done;
+}
+
+static ssize_t file_write(Ram_file *f, const char *buf, size_t size) {
+    Ram_node *n = f->node;
+    size_t done = 0;
+    while (done < size) {
+        unsigned long i = f->pos / RAM_EXTENT, o = f->pos % RAM_EXTENT;
+        size_t l = RAM_EXTENT - o;
+        if (l > size - done) l = size - done;
+        if (i >= n->extentcount && grow(n, i + 1)) break;
+        if (n->extents[i] == NULL) {
+            n->extents[i] = extent_new(n->disk);
+            if (n->extents[i] == NULL) break;
+        }
+        memcpy(n->extents[i] + o, buf + done, l);
+        done += l;
+        f->pos += l;
+        if (f->pos > n->size) n->size = f->pos;
+    }
+    if (done != 0) n->time = time(NULL);
+    return (done != 0 || size == 0) ? (ssize_t)done : -1;
+}
+
+static int file_seek(Ram_file *f, long long *offset, int whence) {
+    long long pos = *offset;
+    switch (whence) {
+    case SEEK_SET: break;
+    case SEEK_CUR: pos += f->pos; break;
+    case SEEK_END: pos += f->node->size; break;
+    default: errno = EINVAL; return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+static int file_close(Ram_file *f) {
+    Ram_file **p;
+    for (p = &files; *p != NULL; p = &(*p)->next) {
+        if (*p != f) continue;
+        *p = f->next;
+        break;
+    }
+    node_put(f->node);
+    free(f);
+    return 0;
+}
+
+#ifdef __GLIBC__
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+    return file_read((Ram_file *)cookie, buf, size);
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size) {
+    return file_write((Ram_file *)cookie, buf, size);
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+    long long pos = *offset;
+    if (file_seek((Ram_file *)cookie, &pos, whence)) return -1;
+    *offset = pos;
+    return 0;
+}
+
+static int cookie_close(void *cookie) {
+    return file_close((Ram_file *)cookie);
+}
+
+static FILE *file_stream(Ram_file *f, int writable) {
+    cookie_io_functions_t io = {cookie_read, cookie_write, cookie_seek, cookie_close};
+    return fopencookie(f, writable ? "r+b" : "rb", io);
+}
+#else
+static int cookie_read(void *cookie, char *buf, int size) {
+    return file_read((Ram_file *)cookie, buf, size);
+}
+
+static int cookie_write(void *cookie, const char *buf, int size) {
+    return file_write((Ram_file *)cookie, buf, size);
+}
+
+static fpos_t cookie_seek(void *cookie, fpos_t offset, int whence) {
+    long long pos = offset;
+    if (file_seek((Ram_file *)cookie, &pos, whence)) return -1;
+    return pos;
+}
+
+static int cookie_close(void *cookie) {
+    return file_close((Ram_file *)cookie);
+}
+
+static FILE *file_stream(Ram_file *f, int writable) {
+    return funopen(f, cookie_read, writable ? cookie_write : NULL, cookie_seek, cookie_close);
+}
+#endif
+
+FILE *ram_fopen(const char *path, int flags) {
+    int writable = (flags & O_ACCMODE) != O_RDONLY;
+    Ram_file *f;
+    Ram_node *n = lookup(path);
+
+    if (n == NULL) {
+        const char *name;
+        Ram_node *p;
+        if (errno != ENOENT || !(flags & O_CREAT)) return NULL;
+        p = parent(path, &name);
+        if (p == NULL) return NULL;
+        n = node_new(p, name, 0);
+        if (n == NULL) return NULL;
+    } else if (n->dir) {
+        errno = EISDIR;
+        return NULL;
+    } else if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+        errno = EEXIST;
+        return NULL;
+    } else if (writable && (flags & O_TRUNC)) {
+        truncate_node(n, 0);
+    }
+    f = (Ram_file *)malloc(sizeof *f);
+    if (f == NULL) return NULL;
+    f->node = n;
+    f->pos = 0;
+    n->refs++;
+    f->stream = file_stream(f, writable);
+    if (f->stream == NULL) {
+        node_put(n);
+        free(f);
+        return NULL;
+    }
+    setvbuf(f->stream, NULL, _IONBF, 0);
+    f->next = files;
+    files = f;
+    return f->stream;
+}
+
+int ram_ftruncate(FILE *stream, unsigned long size) {
+    Ram_file *f;
+    for (f = files; f != NULL; f = f->next) {
+        if (f->stream != stream) continue;
+        truncate_node(f->node, size);
+        return 0;
+    }
+    errno = EBADF;
+    return -1;
+}
+
+int ram_mkdir(const char *path) {
+    const char *name;
+    Ram_node *p;
+    if (lookup(path) != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (errno != ENOENT) return -1;
+    p = parent(path, &name);
+    if (p == NULL) return -1;
+    return (node_new(p, name, 1) == NULL) ? -1 : 0;
+}
+
+int ram_rmdir(const char *path) {
+    Ram_node *n = lookup(path);
+    if (n == NULL) return -1;
+    if (!n->dir) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (n == n->disk->root) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (n->child != NULL) {
+        errno = ENOTEMPTY;
+        return -1;
+    }
+    detach(n);
+    node_put(n);
+    return 0;
+}
+
+int ram_unlink(const char *path) {
+    Ram_node *n = lookup(path);
+    if (n == NULL) return -1;
+    if (n->dir) {
+        errno = EISDIR;
+        return -1;
+    }
+    detach(n);
+    node_put(n);
+    return 0;
+}
+
+int ram_rename(const char *from, const char *to, int replace) {
+    const char *name;
+    char *copy;
+    Ram_node *p, *t, *n = lookup(from);
+
+    if (n == NULL) return -1;
+    if (n == n->disk->root) {
+        errno = EBUSY;
+        return -1;
+    }
+    p = parent(to, &name);
+    if (p == NULL) return -1;
+    if (p->disk != n->disk) {
+        errno = EXDEV;
+        return -1;
+    }
+    for (t = p; t != NULL; t = t->parent) {
+        if (t != n) continue;
+        errno = EINVAL;
+        return -1;
+    }
+    t = lookup(to);
+    if (t == n) return 0;
+    if (t != NULL) {
+        if (!replace) {
+            errno = EEXIST;
+            return -1;
+        }
+        if (t->dir || n->dir) {
+            errno = t->dir ? EISDIR : ENOTDIR;
+            return -1;
+        }
+    }
+    copy = strdup(name);
+    if (copy == NULL) return -1;
+    if (t != NULL) {
+        detach(t);
+        node_put(t);
+    }
+    detach(n);
+    free(n->name);
+    n->name = copy;
+    attach(p, n);
+    return 0;
+}
+#else
+const char *ram_create(unsigned long size) {
+    (void)size;
+    errno = ENOSYS;
+    return NULL;
+}
+
+int ram_path(const char *path) {
+    (void)path;
+    return 0;
+}
+
+Ram_dir *ram_opendir(const char *path) {
+    (void)path;
+    errno = ENOSYS;
+    return NULL;
+}
+
+const char *ram_readdir(Ram_dir *dir, int *isdir, unsigned long *size, time_t *time) {
+    (void)dir; (void)isdir; (void)size; (void)time;
+    return NULL;
+}
+
+void ram_closedir(Ram_dir *dir) {
+    (void)dir;
+}
+
+int ram_stat(const char *path, unsigned long *size) {
+    (void)path; (void)size;
+    errno = ENOSYS;
+    return -1;
+}
+
+FILE *ram_fopen(const char *path, int flags) {
+    (void)path; (void)flags;
+    errno = ENOSYS;
+    return NULL;
+}
+
+int ram_ftruncate(FILE *stream, unsigned long size) {
+    (void)stream; (void)size;
+    errno = ENOSYS;
+    return -1;
+}
+
+int ram_mkdir(const char *path) {
+    (void)path;
+    errno = ENOSYS;
+    return -1;
+}
+
+int ram_rmdir(const char *path) {
+    (void)path;
+    errno = ENOSYS;
+    return -1;
+}
+
+int ram_unlink(const char *path) {
+    (void)path;
+    errno = ENOSYS;
+    return -1;
+}
+
+int ram_rename(const char *from, const char *to, int replace) {
+    (void)from; (void)to; (void)replace;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
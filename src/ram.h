@@ -0,0 +1,43 @@
+/*
+
+ ram.h
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _RAM_H
+#define _RAM_H
+#include <stdio.h>
+#include <time.h>
+
+#define RAM_ROOT "/:ram"
+
+typedef struct Ram_dir Ram_dir;
+
+extern const char *ram_create(unsigned long);
+extern int ram_path(const char *);
+extern Ram_dir *ram_opendir(const char *);
+extern const char *ram_readdir(Ram_dir *, int *, unsigned long *, time_t *);
+extern void ram_closedir(Ram_dir *);
+extern int ram_stat(const char *, unsigned long *);
+extern FILE *ram_fopen(const char *, int);
+extern int ram_ftruncate(FILE *, unsigned long);
+extern int ram_mkdir(const char *);
+extern int ram_rmdir(const char *);
+extern int ram_unlink(const char *);
+extern int ram_rename(const char *, const char *, int);
+#endif
@@ -318,6 +318,12 @@ static void sendbytes(const unsigned char data[], unsigned int bytes) {
     } while (bytes > 0);
 }
 
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    while (bytes > 0) {
+        sendb(data[--bytes]);
+    }
+}
+
 static void eshutdown(void) {
 #ifndef WIN32
     tcflush(commhandle, TCIOFLUSH);
@@ -378,6 +384,7 @@ static Driver driver = {
     .sendb        = sendb,
     .getbytes     = getbytes,
     .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
     .shutdown     = eshutdown,
     .flush        = flush,
     .done         = done,
@@ -0,0 +1,193 @@
+/*
+
+ shm.c - PCLink over a shared memory segment
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "shm.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "shmlink.h"
+#include "crc8.h"
+#include "log.h"
+#include "driver.h"
+#include "memrev.h"
+
+#define SEGMENT_NAME "/ideservd"
+#define PEER_TIMEOUT 1000
+
+static Shmlink *shm;
+static unsigned char ebufi[4096], ebufr[4096];
+static unsigned int ebufip, ebufil;
+static unsigned int txhead;
+static const char *i_name;
+static int driver_errno;
+
+static int peer_alive(void) {
+    int pid = shm->peer_pid;
+    return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static int initialize(int lastfail) {
+    if (shm == NULL) shm = shmlink_attach(i_name);
+    if (shm == NULL) {
+        if (lastfail != -1) log_printf("Cannot attach to %s: %s(%d)", i_name, strerror(errno), errno);
+        return -1;
+    }
+    if (!peer_alive()) {
+        if (lastfail != -2) log_printf("Peer of %s is not running", i_name);
+        shmlink_detach(shm);
+        shm = NULL;
+        return -2;
+    }
+    shm->server_pid = getpid();
+    txhead = shm->pc.head;
+    ebufip = ebufil = 0;
+    log_printf("Attached to %s", i_name);
+    return 0;
+}
+
+static int refill(void) {
+    if (driver_errno == 0) {
+        ebufip = ebufil = 0;
+        for (;;) {
+            ebufil = shmring_get(&shm->c64, ebufi, sizeof ebufi);
+            if (ebufil != 0) break;
+            if (shmring_wait_data(&shm->c64, PEER_TIMEOUT) && !peer_alive()) return -EIO;
+        }
+    }
+    return driver_errno;
+}
+
+static int getb(int use_timeout) {
+    unsigned char a;
+    (void)use_timeout;
+    if (ebufip >= ebufil) {
+        driver_errno = refill();
+        if (driver_errno != 0) return EOF;
+    }
+    a = ebufi[ebufip++];
+    crc_add_byte(a);
+    return a;
+}
+
+static void put(const unsigned char data[], unsigned int bytes) {
+    while (driver_errno == 0) {
+        unsigned int l = shmring_put(&shm->pc, &txhead, data, bytes);
+        data += l; bytes -= l;
+        if (bytes == 0) break;
+        shmring_publish(&shm->pc, txhead);
+        if (shmring_wait_space(&shm->pc, txhead, PEER_TIMEOUT) && !peer_alive()) driver_errno = -EIO;
+    }
+}
+
+static void sendb(unsigned char a) {
+    crc_add_byte(a);
+    put(&a, 1);
+}
+
+static void getbytes(unsigned char data[], unsigned int bytes) {
+    while (ebufip + bytes > ebufil) {
+        ebufil -= ebufip;
+        memcpy(data, ebufi + ebufip, ebufil);
+        crc_add_block(data, ebufil);
+        data += ebufil; bytes -= ebufil;
+        driver_errno = refill();
+        if (driver_errno != 0) return;
+    }
+    memcpy(data, ebufi + ebufip, bytes);
+    crc_add_block(data, bytes);
+    ebufip += bytes;
+}
+
+static void sendbytes(const unsigned char data[], unsigned int bytes) {
+    crc_add_block(data, bytes);
+    put(data, bytes);
+}
+
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    while (bytes > 0) {
+        unsigned int l = bytes < sizeof ebufr ? bytes : sizeof ebufr;
+        bytes -= l;
+        memrevcpy(ebufr, data + bytes, l);
+        crc_add_block(ebufr, l);
+        put(ebufr, l);
+    }
+}
+
+static void eshutdown(void) {
+    if (shm != NULL) {
+        shm->server_pid = 0;
+        shmlink_detach(shm);
+    }
+    shm = NULL;
+}
+
+static int flush(void) {
+    if (driver_errno == 0) shmring_publish(&shm->pc, txhead);
+    return driver_errno;
+}
+
+static int done(void) {
+    return driver_errno;
+}
+
+static void turn(void) {
+}
+
+static int clean(void) {
+    ebufip = 0;
+    ebufil = 0;
+    if (shm != NULL) txhead = shm->pc.head;
+    return 0;
+}
+
+static int waitb(unsigned char ec) {
+    int i;
+    (void)ec;
+    if (shm == NULL) return -ENODEV;
+    driver_errno = 0;
+    i = getb(1);
+    return (i != EOF) ? i : driver_errno;
+}
+
+static const Driver driver = {
+    .name         = "shared memory",
+    .initialize   = initialize,
+    .getb         = getb,
+    .sendb        = sendb,
+    .getbytes     = getbytes,
+    .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
+    .shutdown     = eshutdown,
+    .flush        = flush,
+    .done         = done,
+    .turn         = turn,
+    .wait         = waitb,
+    .clean        = clean,
+};
+
+const Driver *shm_driver(const char *name) {
+    i_name = name != NULL ? name : SEGMENT_NAME;
+    log_printf("Using %s driver attached to %s", driver.name, i_name);
+    return &driver;
+}
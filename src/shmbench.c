@@ -0,0 +1,160 @@
+/*
+
+ shmbench.c - Status round trip benchmark for the shm and vice modes
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "shmlink.h"
+
+#define SEGMENT_NAME "/ideservd"
+#define VICE_PORT 64245
+#define PEER_TIMEOUT 1000
+
+static const unsigned char request[] = {'I', 0x0f, 0x00, 0x5a};
+
+static Shmlink *shm;
+static unsigned int txhead;
+static int sock = -1;
+
+static int shm_send(const unsigned char *data, unsigned int bytes) {
+    while (bytes > 0) {
+        unsigned int l = shmring_put(&shm->c64, &txhead, data, bytes);
+        data += l; bytes -= l;
+        shmring_publish(&shm->c64, txhead);
+        if (bytes != 0 && shmring_wait_space(&shm->c64, txhead, PEER_TIMEOUT)) return -1;
+    }
+    return 0;
+}
+
+static int shm_receive(unsigned char *data, unsigned int bytes) {
+    while (bytes > 0) {
+        unsigned int l = shmring_get(&shm->pc, data, bytes);
+        data += l; bytes -= l;
+        if (l == 0 && shmring_wait_data(&shm->pc, PEER_TIMEOUT) && shm->server_pid == 0) return -1;
+    }
+    return 0;
+}
+
+static int tcp_send(const unsigned char *data, unsigned int bytes) {
+    return send(sock, data, bytes, 0) == (ssize_t)bytes ? 0 : -1;
+}
+
+static int tcp_receive(unsigned char *data, unsigned int bytes) {
+    while (bytes > 0) {
+        ssize_t l = recv(sock, data, bytes, 0);
+        if (l <= 0) return -1;
+        data += l; bytes -= l;
+    }
+    return 0;
+}
+
+static int shm_open_peer(const char *name) {
+    shm = shmlink_create(name);
+    if (shm == NULL) {
+        perror(name);
+        return -1;
+    }
+    fprintf(stderr, "Waiting for ideservd -m shm -i %s\n", name);
+    while (shm->server_pid == 0) usleep(10000);
+    return 0;
+}
+
+static int tcp_open_peer(void) {
+    struct sockaddr_in addr;
+    int one = 1, ls = socket(AF_INET, SOCK_STREAM, 0);
+    if (ls < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(VICE_PORT);
+    if (bind(ls, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(ls, 1) < 0) {
+        perror("bind");
+        close(ls);
+        return -1;
+    }
+    fprintf(stderr, "Waiting for ideservd -m vice\n");
+    sock = accept(ls, NULL, NULL);
+    close(ls);
+    if (sock < 0) {
+        perror("accept");
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int (*sendf)(const unsigned char *, unsigned int) = shm_send;
+    int (*receivef)(unsigned char *, unsigned int) = shm_receive;
+    const char *name = SEGMENT_NAME;
+    unsigned long i, count = 100000;
+    unsigned char reply[258];
+    struct timespec start, end;
+    double elapsed;
+    int tcp = 0, arg = 1;
+
+    if (arg < argc && !strcmp(argv[arg], "-t")) {
+        tcp = 1;
+        arg++;
+    }
+    if (arg < argc) count = strtoul(argv[arg++], NULL, 0);
+    if (arg < argc) name = argv[arg++];
+    if (arg < argc || count == 0) {
+        fprintf(stderr, "Usage: %s [-t] [count] [segment]\n", argv[0]);
+        return 1;
+    }
+
+    if (tcp) {
+        if (tcp_open_peer()) return 1;
+        sendf = tcp_send;
+        receivef = tcp_receive;
+    } else if (shm_open_peer(name)) return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if (sendf(request, sizeof request) || receivef(reply, 1) || receivef(reply + 1, reply[0] + 1U)) {
+            fprintf(stderr, "Lost the server after %lu requests\n", i);
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    if (i != 0) printf("%s: %lu status round trips, %.1f us each\n", tcp ? "vice" : "shm", i, elapsed / i);
+
+    if (tcp) close(sock);
+    else {
+        shmlink_detach(shm);
+        shm_unlink(name);
+    }
+    return i == count ? 0 : 1;
+}
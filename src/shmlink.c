@@ -0,0 +1,157 @@
+/*
+
+ shmlink.c - Ring buffers of the shared memory link
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "shmlink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+Shmlink *shmlink_create(const char *name) {
+    Shmlink *link;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, sizeof *link)) {
+        close(fd);
+        return NULL;
+    }
+    link = (Shmlink *)mmap(NULL, sizeof *link, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (link == MAP_FAILED) return NULL;
+    memset(link, 0, sizeof *link);
+    link->version = SHMLINK_VERSION;
+    link->peer_pid = getpid();
+    __atomic_store_n(&link->magic, SHMLINK_MAGIC, __ATOMIC_RELEASE);
+    return link;
+}
+
+Shmlink *shmlink_attach(const char *name) {
+    Shmlink *link;
+    struct stat st;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof *link) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    link = (Shmlink *)mmap(NULL, sizeof *link, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (link == MAP_FAILED) return NULL;
+    if (__atomic_load_n(&link->magic, __ATOMIC_ACQUIRE) != SHMLINK_MAGIC || link->version != SHMLINK_VERSION) {
+        munmap(link, sizeof *link);
+        errno = EPROTO;
+        return NULL;
+    }
+    return link;
+}
+
+void shmlink_detach(Shmlink *link) {
+    munmap(link, sizeof *link);
+}
+
+static int sleep_on(volatile unsigned int *addr, unsigned int value, int timeout) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    if (syscall(SYS_futex, addr, FUTEX_WAIT, value, &ts, NULL, 0) < 0 && errno == ETIMEDOUT) return 1;
+    return 0;
+#else
+    int dyntime = 1;
+    while (timeout > 0 && __atomic_load_n(addr, __ATOMIC_SEQ_CST) == value) {
+        usleep(dyntime);
+        timeout -= dyntime / 1000;
+        if (dyntime < 16384) dyntime <<= 1;
+    }
+    return timeout <= 0;
+#endif
+}
+
+static void wake(volatile unsigned int *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+
+unsigned int shmring_put(Shmring *ring, unsigned int *head, const unsigned char *data, unsigned int bytes) {
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned int space = SHMLINK_RING_SIZE - (*head - tail);
+    unsigned int pos = *head & (SHMLINK_RING_SIZE - 1);
+    unsigned int l;
+    if (bytes > space) bytes = space;
+    l = SHMLINK_RING_SIZE - pos;
+    if (l > bytes) l = bytes;
+    memcpy(ring->data + pos, data, l);
+    memcpy(ring->data, data + l, bytes - l);
+    *head += bytes;
+    return bytes;
+}
+
+void shmring_publish(Shmring *ring, unsigned int head) {
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head_waiters, __ATOMIC_SEQ_CST) != 0) wake(&ring->head);
+}
+
+unsigned int shmring_get(Shmring *ring, unsigned char *data, unsigned int bytes) {
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = ring->tail;
+    unsigned int pos = tail & (SHMLINK_RING_SIZE - 1);
+    unsigned int l;
+    if (bytes > head - tail) bytes = head - tail;
+    if (bytes == 0) return 0;
+    l = SHMLINK_RING_SIZE - pos;
+    if (l > bytes) l = bytes;
+    memcpy(data, ring->data + pos, l);
+    memcpy(data + l, ring->data, bytes - l);
+    __atomic_store_n(&ring->tail, tail + bytes, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail_waiters, __ATOMIC_SEQ_CST) != 0) wake(&ring->tail);
+    return bytes;
+}
+
+int shmring_wait_data(Shmring *ring, int timeout) {
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    int expired = 0;
+    if (head != ring->tail) return 0;
+    __atomic_add_fetch(&ring->head_waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == head) expired = sleep_on(&ring->head, head, timeout);
+    __atomic_sub_fetch(&ring->head_waiters, 1, __ATOMIC_SEQ_CST);
+    return expired;
+}
+
+int shmring_wait_space(Shmring *ring, unsigned int head, int timeout) {
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    int expired = 0;
+    if (head - tail < SHMLINK_RING_SIZE) return 0;
+    __atomic_add_fetch(&ring->tail_waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail) expired = sleep_on(&ring->tail, tail, timeout);
+    __atomic_sub_fetch(&ring->tail_waiters, 1, __ATOMIC_SEQ_CST);
+    return expired;
+}
@@ -0,0 +1,66 @@
+/*
+
+ shmlink.h
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _SHMLINK_H
+#define _SHMLINK_H
+
+/*
+ Shared memory link between ideservd and an emulator on the same host.
+
+ The emulator creates the segment with shmlink_create() and ideservd
+ attaches to it with shmlink_attach(). The "c64" ring carries bytes from the
+ emulated C64 to ideservd, the "pc" ring the replies. Each ring has a single
+ producer and a single consumer. The producer fills data and then publishes
+ by advancing head, the consumer advances tail after copying. Both counters
+ run freely and are reduced modulo SHMLINK_RING_SIZE. A side waiting for
+ data or space sleeps on the counter the other side advances.
+*/
+
+#define SHMLINK_MAGIC 0x4c4d4853
+#define SHMLINK_VERSION 1
+#define SHMLINK_RING_SIZE 65536
+
+typedef struct Shmring {
+    volatile unsigned int head;
+    volatile unsigned int head_waiters;
+    unsigned char pad1[56];
+    volatile unsigned int tail;
+    volatile unsigned int tail_waiters;
+    unsigned char pad2[56];
+    unsigned char data[SHMLINK_RING_SIZE];
+} Shmring;
+
+typedef struct Shmlink {
+    unsigned int magic, version;
+    volatile int peer_pid, server_pid;
+    unsigned char pad[48];
+    Shmring c64, pc;
+} Shmlink;
+
+extern Shmlink *shmlink_create(const char *);
+extern Shmlink *shmlink_attach(const char *);
+extern void shmlink_detach(Shmlink *);
+extern unsigned int shmring_put(Shmring *, unsigned int *, const unsigned char *, unsigned int);
+extern void shmring_publish(Shmring *, unsigned int);
+extern unsigned int shmring_get(Shmring *, unsigned char *, unsigned int);
+extern int shmring_wait_data(Shmring *, int);
+extern int shmring_wait_space(Shmring *, unsigned int, int);
+#endif
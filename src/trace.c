@@ -0,0 +1,471 @@
+/*
+
+ trace.c - Recording and replaying of sessions
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "crc8.h"
+#include "log.h"
+#include "driver.h"
+#include "memrev.h"
+#include "message.h"
+#include "arguments.h"
+
+#define TRACE_MAGIC "IDETRACE\x02"
+
+enum {
+    TR_NONE = -1, TR_RX, TR_TX, TR_COMMAND, TR_END
+};
+
+static FILE *tracefile;
+static unsigned char pending[65536];
+static unsigned int pendinglen;
+static int pendingtype;
+static unsigned long long pendingtime, lasttime;
+
+static unsigned long long trace_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000ull + tv.tv_usec;
+    }
+}
+
+static void put_varint(unsigned long long v) {
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, tracefile);
+        v >>= 7;
+    }
+    putc(v, tracefile);
+}
+
+static void record_head(int type, unsigned long long when) {
+    putc(type, tracefile);
+    put_varint(when - lasttime);
+    lasttime = when;
+}
+
+static void record_flush(void) {
+    if (pendinglen == 0) return;
+    record_head(pendingtype, pendingtime);
+    put_varint(pendinglen);
+    fwrite(pending, 1, pendinglen, tracefile);
+    pendinglen = 0;
+}
+
+static void record_data(int type, const unsigned char data[], unsigned int len) {
+    while (len > 0) {
+        unsigned int l;
+        if (pendinglen != 0 && (pendingtype != type || pendinglen == sizeof pending)) record_flush();
+        if (pendinglen == 0) {
+            pendingtype = type;
+            pendingtime = trace_now();
+        }
+        l = sizeof pending - pendinglen;
+        if (l > len) l = len;
+        memcpy(pending + pendinglen, data, l);
+        pendinglen += l;
+        data += l;
+        len -= l;
+    }
+}
+
+void trace_open(const char *prefix, int mode) {
+    char path[1024];
+    if (prefix == NULL) return;
+    snprintf(path, sizeof path, "%s.%d", prefix, (int)getpid());
+    tracefile = fopen(path, "wb");
+    if (tracefile == NULL) {
+        log_printf("Cannot create trace file \"%s\": %s(%d)", path, strerror(errno), errno);
+        return;
+    }
+    setvbuf(tracefile, NULL, _IOFBF, 65536);
+    fwrite(TRACE_MAGIC, 1, sizeof TRACE_MAGIC - 1, tracefile);
+    putc(mode, tracefile);
+    lasttime = trace_now();
+    log_printf("Recording session into \"%s\"", path);
+}
+
+static const Driver *inner;
+static Driver wrapper;
+
+static int t_initialize(int lastfail) {
+    return inner->initialize(lastfail);
+}
+
+static int t_getb(int a) {
+    int c = inner->getb(a);
+    if (c != EOF) {
+        unsigned char b = c;
+        record_data(TR_RX, &b, 1);
+    }
+    return c;
+}
+
+static void t_sendb(unsigned char c) {
+    record_data(TR_TX, &c, 1);
+    inner->sendb(c);
+}
+
+static void t_getbytes(unsigned char data[], unsigned int len) {
+    inner->getbytes(data, len);
+    if (inner->done() == 0) record_data(TR_RX, data, len);
+}
+
+static void t_sendbytes(const unsigned char data[], unsigned int len) {
+    record_data(TR_TX, data, len);
+    inner->sendbytes(data, len);
+}
+
+static void t_sendrbytes(const unsigned char data[], unsigned int len) {
+    record_data(TR_TX, data, len);
+    inner->sendrbytes(data, len);
+}
+
+static void t_shutdown(void) {
+    inner->shutdown();
+    record_flush();
+    fflush(tracefile);
+}
+
+static int t_flush(void) {
+    return inner->flush();
+}
+
+static int t_done(void) {
+    return inner->done();
+}
+
+static void t_turn(void) {
+    inner->turn();
+}
+
+static int t_wait(unsigned char ec) {
+    int c = inner->wait(ec);
+    if (c >= 0) {
+        record_flush();
+        record_head(TR_COMMAND, trace_now());
+        putc(c, tracefile);
+    }
+    return c;
+}
+
+static int t_clean(void) {
+    return inner->clean();
+}
+
+const Driver *trace_driver(const Driver *driver) {
+    if (tracefile == NULL) return driver;
+    inner = driver;
+    wrapper.name = driver->name;
+    wrapper.initialize = t_initialize;
+    wrapper.getb = t_getb;
+    wrapper.sendb = t_sendb;
+    wrapper.getbytes = t_getbytes;
+    wrapper.sendbytes = t_sendbytes;
+    wrapper.sendrbytes = t_sendrbytes;
+    wrapper.shutdown = t_shutdown;
+    wrapper.flush = t_flush;
+    wrapper.done = t_done;
+    wrapper.turn = t_turn;
+    wrapper.wait = t_wait;
+    wrapper.clean = t_clean;
+    return &wrapper;
+}
+
+static const char *r_name;
+static int r_realtime, r_mode;
+static unsigned char *trace;
+static size_t tracelen, tracepos;
+static int rtype = TR_NONE;
+static const unsigned char *rdata;
+static unsigned int rlen, roff;
+static long rresult;
+static unsigned long long mark, startedat;
+static unsigned long commands, results, differ;
+static int driver_errno;
+
+static int get_varint(unsigned long long *v) {
+    unsigned int s = 0;
+    *v = 0;
+    while (tracepos < tracelen && s < 64) {
+        unsigned char c = trace[tracepos++];
+        *v |= (unsigned long long)(c & 0x7f) << s;
+        if (!(c & 0x80)) return 0;
+        s += 7;
+    }
+    return -1;
+}
+
+static void pace(unsigned long long delta) {
+    unsigned long long now = trace_now();
+    if (mark + delta > now) {
+        usleep(mark + delta - now);
+        now = mark + delta;
+    }
+    mark = now;
+}
+
+static int advance(void) {
+    unsigned long long delta, v;
+    int type = trace[tracepos++];
+    if (get_varint(&delta)) return -1;
+    switch (type) {
+    case TR_RX:
+    case TR_TX:
+        if (get_varint(&v) || v > tracelen - tracepos) return -1;
+        rlen = v;
+        break;
+    case TR_COMMAND:
+        if (tracepos >= tracelen) return -1;
+        rlen = 1;
+        break;
+    case TR_END:
+        if (get_varint(&v)) return -1;
+        rresult = (v & 1) ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+        rlen = 0;
+        break;
+    default:
+        return -1;
+    }
+    rdata = trace + tracepos;
+    tracepos += rlen;
+    roff = 0;
+    rtype = type;
+    if (r_realtime) pace((type == TR_RX || type == TR_COMMAND) ? delta : 0);
+    return 0;
+}
+
+static int current(void) {
+    if (rtype == TR_NONE && tracepos < tracelen && advance()) {
+        log_printf("Trace \"%s\" is corrupt at offset %lu", r_name, (unsigned long)tracepos);
+        tracepos = tracelen;
+        rtype = TR_NONE;
+    }
+    return rtype;
+}
+
+static int receive(unsigned char data[], unsigned int len) {
+    while (len > 0) {
+        unsigned int l;
+        switch (current()) {
+        case TR_RX: break;
+        case TR_TX: differ += rlen - roff; rtype = TR_NONE; continue;
+        default: return -EIO;
+        }
+        l = rlen - roff;
+        if (l > len) l = len;
+        memcpy(data, rdata + roff, l);
+        roff += l;
+        data += l;
+        len -= l;
+        if (roff == rlen) rtype = TR_NONE;
+    }
+    return 0;
+}
+
+static void transmit(const unsigned char data[], unsigned int len) {
+    while (len > 0) {
+        unsigned int l, i;
+        if (current() != TR_TX) {
+            differ += len;
+            return;
+        }
+        l = rlen - roff;
+        if (l > len) l = len;
+        for (i = 0; i < l; i++) differ += data[i] != rdata[roff + i];
+        roff += l;
+        data += l;
+        len -= l;
+        if (roff == rlen) rtype = TR_NONE;
+    }
+}
+
+void trace_end(int result) {
+    if (tracefile != NULL) {
+        record_flush();
+        record_head(TR_END, trace_now());
+        put_varint(result < 0 ? ((unsigned long long)-(result + 1) << 1) | 1 : (unsigned long long)result << 1);
+    }
+    if (trace == NULL) return;
+    for (;;) {
+        switch (current()) {
+        case TR_END: results += rresult != result; rtype = TR_NONE; return;
+        case TR_COMMAND:
+        case TR_NONE: results++; return;
+        case TR_TX: differ += rlen - roff; break;
+        }
+        rtype = TR_NONE;
+    }
+}
+
+static int initialize(int lastfail) {
+    FILE *f = fopen(r_name, "rb");
+    long size = 0;
+    if (f == NULL) {
+        if (lastfail != -1) log_printf("Cannot open trace \"%s\": %s(%d)", r_name, strerror(errno), errno);
+        return -1;
+    }
+    free(trace);
+    trace = NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        trace = (unsigned char *)malloc(size + 1);
+        if (trace != NULL && fread(trace, 1, size, f) != (size_t)size) {
+            free(trace);
+            trace = NULL;
+        }
+    }
+    fclose(f);
+    if (trace == NULL || size < (long)sizeof TRACE_MAGIC || memcmp(trace, TRACE_MAGIC, sizeof TRACE_MAGIC - 1)) {
+        if (lastfail != -2) log_printf("Trace \"%s\" is not readable", r_name);
+        return -2;
+    }
+    tracelen = size;
+    tracepos = sizeof TRACE_MAGIC - 1;
+    r_mode = trace[tracepos++];
+    rtype = TR_NONE;
+    commands = results = differ = 0;
+    driver_errno = 0;
+    startedat = mark = trace_now();
+    log_printf("Replaying %s", r_name);
+    return 0;
+}
+
+static int getb(int use_timeout) {
+    unsigned char a;
+    (void)use_timeout;
+    if (driver_errno == 0) {
+        if (r_mode == M_ETHERNET && current() != TR_RX) return EOF;
+        driver_errno = receive(&a, 1);
+    }
+    if (driver_errno != 0) return EOF;
+    crc_add_byte(a);
+    return a;
+}
+
+static void sendb(unsigned char a) {
+    crc_add_byte(a);
+    transmit(&a, 1);
+}
+
+static void getbytes(unsigned char data[], unsigned int bytes) {
+    if (driver_errno == 0) driver_errno = receive(data, bytes);
+    if (driver_errno == 0) crc_add_block(data, bytes);
+}
+
+static void sendbytes(const unsigned char data[], unsigned int bytes) {
+    crc_add_block(data, bytes);
+    transmit(data, bytes);
+}
+
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    unsigned char ebufr[4096];
+    unsigned int i;
+    for (i = bytes; i > 0;) {
+        unsigned int l = i < sizeof ebufr ? i : sizeof ebufr;
+        i -= l;
+        memrevcpy(ebufr, data + i, l);
+        crc_add_block(ebufr, l);
+    }
+    transmit(data, bytes);
+}
+
+static void eshutdown(void) {
+    if (trace == NULL) return;
+    log_printf("Replayed %lu commands in %.3f s, %lu results and %lu bytes differed", commands,
+               (trace_now() - startedat) / 1e6, results, differ);
+    free(trace);
+    trace = NULL;
+}
+
+static int flush(void) {
+    return driver_errno;
+}
+
+static int done(void) {
+    return driver_errno;
+}
+
+static void turn(void) {
+}
+
+static int clean(void) {
+    return 0;
+}
+
+static int waitb(unsigned char ec) {
+    (void)ec;
+    if (trace == NULL) return -ENODEV;
+    driver_errno = 0;
+    for (;;) {
+        switch (current()) {
+        case TR_NONE: return -ENODEV;
+        case TR_COMMAND:
+            rtype = TR_NONE;
+            commands++;
+            crc_add_byte(rdata[0]);
+            return rdata[0];
+        case TR_TX: differ += rlen - roff; break;
+        }
+        rtype = TR_NONE;
+    }
+}
+
+static const Driver driver = {
+    .name         = "replay",
+    .initialize   = initialize,
+    .getb         = getb,
+    .sendb        = sendb,
+    .getbytes     = getbytes,
+    .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
+    .shutdown     = eshutdown,
+    .flush        = flush,
+    .done         = done,
+    .turn         = turn,
+    .wait         = waitb,
+    .clean        = clean,
+};
+
+int replay_mode(void) {
+    return r_mode;
+}
+
+const Driver *replay_driver(const char *name, int realtime) {
+    if (name == NULL) {
+        message("No trace file given for replay\n");
+        exit(EXIT_FAILURE);
+    }
+    r_name = name;
+    r_realtime = realtime;
+    log_printf("Using %s driver for %s at %s speed", driver.name, name, realtime ? "original" : "full");
+    return &driver;
+}
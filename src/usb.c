@@ -31,12 +31,21 @@
 #include "crc8.h"
 #include "log.h"
 #include "driver.h"
+#include "memrev.h"
 #include "timeout.h"
 
 #ifndef WIN32
 #include <ftdi.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#if defined LIBUSB_API_VERSION && LIBUSB_API_VERSION >= 0x01000102
+#define USB_HOTPLUG
+#define USB_SESSIONS 16
+#endif
 
 static struct ftdi_context *ftDevice;
+static int i_bus = -1, i_address;
 #else
 #include <windows.h>    //also in ideservd.h, but we need it now
 #include "ftd2xx.h"
@@ -47,43 +56,97 @@ FT_HANDLE ftHandle;
 static const char *i_dev;
 static int inited;
 static int driver_errno;
-static unsigned char ebufo[4096];
-static unsigned int ebufop;
+static unsigned char ebufi[4096], ebufo[4096];
+static unsigned int ebufip, ebufil, ebufop;
 static int last_ec;
 
 static int flush(void);
 
+#ifdef USB_HOTPLUG
+static libusb_device *arrived[USB_SESSIONS];
+static unsigned int arrivals;
+
+static int LIBUSB_CALL hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *data) {
+    (void)ctx; (void)event; (void)data;
+    if (arrivals < USB_SESSIONS) arrived[arrivals++] = libusb_ref_device(dev);
+    return 0;
+}
+
+static int watch_arrival(libusb_context *ctx, libusb_hotplug_callback_handle *handle) {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) return -1;
+    if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0, 0x0403, 0x6001,
+                                         LIBUSB_HOTPLUG_MATCH_ANY, hotplug, NULL, handle) != LIBUSB_SUCCESS) return -1;
+    return 0;
+}
+
+static void unwatch_arrival(libusb_context *ctx, libusb_hotplug_callback_handle handle) {
+    libusb_hotplug_deregister_callback(ctx, handle);
+    while (arrivals > 0) libusb_unref_device(arrived[--arrivals]);
+}
+
+static int wait_arrival(libusb_context *ctx, libusb_hotplug_callback_handle handle) {
+    int err = 0;
+    while (arrivals == 0) {
+        int i = libusb_handle_events(ctx);
+        if (i < 0 && i != LIBUSB_ERROR_INTERRUPTED) {
+            err = -1;
+            break;
+        }
+    }
+    unwatch_arrival(ctx, handle);
+    return err;
+}
+#endif
+
 static int initialize(int lastfail) {
 #ifndef WIN32
     struct ftdi_device_list *list, *i, *j;
     char desc[256], serial[256];
+#ifdef USB_HOTPLUG
+    libusb_hotplug_callback_handle handle;
+    int watching;
+#endif
 
     inited = 0;
+#ifdef USB_HOTPLUG
+retry:
+#endif
 
     ftDevice = ftdi_new();
     if (!ftDevice) {
         if (lastfail != -1) log_print("Out of memory");
         return -1;
     }
+#ifdef USB_HOTPLUG
+    watching = lastfail == -3 && i_bus < 0 && !watch_arrival(ftDevice->usb_ctx, &handle);
+#endif
 
     if (ftdi_usb_find_all(ftDevice, &list, 0x0403, 0x6001) < 0) {
         if (lastfail != -2) log_printf("ftdi_usb_find_all: %s", ftdi_get_error_string(ftDevice));
+#ifdef USB_HOTPLUG
+        if (watching) unwatch_arrival(ftDevice->usb_ctx, handle);
+#endif
         ftdi_free(ftDevice);
         ftDevice = NULL;
         return -2;
     }
 
     for (i = list; i; i = i->next) {
+        if (i_bus >= 0 && (libusb_get_bus_number(i->dev) != i_bus || libusb_get_device_address(i->dev) != i_address)) {
+            continue;
+        }
         if (ftdi_usb_get_strings(ftDevice, i->dev, NULL, 0, desc, sizeof desc, serial, sizeof serial) < 0) {
             continue;
         }
-        if (i_dev != NULL) {
+        if (i_bus >= 0 && i_dev == NULL) {
+            if (!strcmp(desc, "IDE64 USB DEVICE") || !strcmp(desc, "FT245R USB FIFO")) break;
+        } else if (i_dev != NULL) {
             if (!strcmp(i_dev, serial)) break;
         } else {
             if (!strcmp(desc, "IDE64 USB DEVICE")) break;
         }
     }
-    if (!i && i_dev == NULL) {
+    if (!i && i_dev == NULL && i_bus < 0) {
         for (i = list; i; i = i->next) {
             if (ftdi_usb_get_strings(ftDevice, i->dev, NULL, 0, desc, sizeof desc, serial, sizeof serial) < 0) {
                 continue;
@@ -91,7 +154,7 @@ static int initialize(int lastfail) {
             if (!strcmp(desc, "FT245R USB FIFO")) break;
         }
     }
-    for (j = list; j; j = j->next) {
+    for (j = list; j && i_bus < 0; j = j->next) {
         char desc2[256], serial2[256];
         if (i == j) {
             continue;
@@ -104,10 +167,19 @@ static int initialize(int lastfail) {
     if (!i) {
         ftdi_list_free(&list);
         if (lastfail != -3) log_print("No usable USB device found for now");
+#ifdef USB_HOTPLUG
+        if (watching && !wait_arrival(ftDevice->usb_ctx, handle)) {
+            ftdi_free(ftDevice);
+            goto retry;
+        }
+#endif
         ftdi_free(ftDevice);
         ftDevice = NULL;
         return -3;
     }
+#ifdef USB_HOTPLUG
+    if (watching) unwatch_arrival(ftDevice->usb_ctx, handle);
+#endif
     if (ftdi_usb_open_dev(ftDevice, i->dev)) {
         ftdi_list_free(&list);
         if (lastfail != -4) log_printf("ftdi_usb_open_dev: %s", ftdi_get_error_string(ftDevice));
@@ -192,93 +264,98 @@ static int initialize(int lastfail) {
 //     FT_SetDeadmanTimeout(ftHandle, 10);
 #endif
     timeout_init();
+    ebufip = ebufil = 0;
     last_ec = -1;
     inited = 1;
     return 0;
 }
 
+static int readdata(unsigned char data[], unsigned int len) {
+#ifndef WIN32
+    int err = ftdi_read_data(ftDevice, data, len);
+    if (err == -ENODEV) return -ENODEV;
+    if (err < 0) return -EIO;
+    return err;
+#else
+    DWORD dwBytesRead;
+    FT_STATUS ftStatus = FT_Read(ftHandle, data, len, &dwBytesRead);
+    if (ftStatus == FT_DEVICE_NOT_FOUND) return -ENODEV;
+    if (ftStatus != FT_OK) return -EIO;
+    return (int)dwBytesRead;
+#endif
+}
+
+static int refill(void) {
+    unsigned int l = sizeof ebufi;
+    int err;
+#ifdef WIN32
+    DWORD dwQueue;
+    FT_STATUS ftStatus = FT_GetQueueStatus(ftHandle, &dwQueue);
+    if (ftStatus == FT_DEVICE_NOT_FOUND) return -ENODEV;
+    if (ftStatus != FT_OK) return -EIO;
+    if (dwQueue < l) l = (dwQueue != 0) ? dwQueue : 1;
+#endif
+    ebufip = ebufil = 0;
+    err = readdata(ebufi, l);
+    if (err > 0) ebufil = err;
+    return err;
+}
+
 static int getb(int use_timeout) {
     unsigned char data;
     if (driver_errno != 0) return EOF;
-    if (use_timeout) timeout_set(1);
-    do {
-#ifndef WIN32
-        int err = ftdi_read_data(ftDevice, &data, 1);
-        if (err == -ENODEV) {
-            driver_errno = -ENODEV;
-            return EOF;
-        }
-        if (err < 0) {
-            driver_errno = -EIO;
-            return EOF;
-        }
-        if (err == 1) {
-            crc_add_byte(data);
-            return data;
-        }
-#else
-        DWORD dwBytesRead;
-        FT_STATUS ftStatus = FT_Read(ftHandle, &data, 1, &dwBytesRead);
-        if (ftStatus == FT_DEVICE_NOT_FOUND) {
-            driver_errno = -ENODEV;
-            return EOF;
-        }
-        if (ftStatus != FT_OK) {
-            driver_errno = -ENODEV;
-            return EOF;
-        }
-        if (dwBytesRead == 1) {
-            crc_add_byte(data);
-            return data;
+    if (ebufip >= ebufil) {
+        if (use_timeout) timeout_set(1);
+        for (;;) {
+            int err = refill();
+            if (err < 0) {
+                driver_errno = err;
+                return EOF;
+            }
+            if (err > 0) break;
+            if (timeout_expired) {
+                driver_errno = -EIO;
+                return EOF;
+            }
         }
-#endif
-    } while (!timeout_expired);
-    driver_errno = -EIO;
-    return EOF;
+    }
+    data = ebufi[ebufip++];
+    crc_add_byte(data);
+    return data;
 }
 
 static void getbytes(unsigned char data[], unsigned int bytes) {
     int err = 1;
-#ifdef WIN32
-    DWORD dwBytesRead;
-    FT_STATUS ftStatus;
-#endif
     if (driver_errno != 0) return;
-    do {
-        unsigned int l;
+    while (bytes > 0) {
+        if (ebufip < ebufil) {
+            unsigned int l = ebufil - ebufip;
+            if (l > bytes) l = bytes;
+            memcpy(data, ebufi + ebufip, l);
+            crc_add_block(data, l);
+            ebufip += l;
+            bytes -= l; data += l;
+            continue;
+        }
         if (err != 0) timeout_set(1);
-        if (bytes > 4096) l = 4096; else l = bytes;
         if (timeout_expired) {
             driver_errno = -EIO;
             return;
         }
-#ifndef WIN32
-        err = ftdi_read_data(ftDevice, data, l);
-        if (err == -ENODEV) {
-            driver_errno = -ENODEV;
-            return;
+        if (bytes >= sizeof ebufi) {
+            err = readdata(data, sizeof ebufi);
+            if (err > 0) {
+                crc_add_block(data, err);
+                bytes -= err; data += err;
+            }
+        } else {
+            err = refill();
         }
         if (err < 0) {
-            driver_errno = -EIO;
+            driver_errno = err;
             return;
         }
-        crc_add_block(data, err);
-        bytes -= err; data += err;
-#else
-        ftStatus = FT_Read(ftHandle, data, l, &dwBytesRead);
-        if (ftStatus == FT_DEVICE_NOT_FOUND) {
-            driver_errno = -ENODEV;
-            return;
-        }
-        if (ftStatus != FT_OK) {
-            driver_errno = -EIO;
-            return;
-        }
-        crc_add_block(data, dwBytesRead);
-        bytes -= dwBytesRead; data += dwBytesRead;
-        err = (int)dwBytesRead;
-#endif
-    } while (bytes > 0);
+    }
 }
 
 static void sendb(unsigned char data) {
@@ -304,6 +381,21 @@ static void sendbytes(const unsigned char data[], unsigned int bytes) {
     ebufop += bytes;
 }
 
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    while (ebufop + bytes > sizeof ebufo) {
+        unsigned int l = sizeof(ebufo) - ebufop;
+        bytes -= l;
+        memrevcpy(ebufo + ebufop, data + bytes, l);
+        crc_add_block(ebufo + ebufop, l);
+        ebufop = sizeof ebufo;
+        driver_errno = flush();
+        if (driver_errno != 0) return;
+    }
+    memrevcpy(ebufo + ebufop, data, bytes);
+    crc_add_block(ebufo + ebufop, bytes);
+    ebufop += bytes;
+}
+
 static void eshutdown(void) {
 #ifndef WIN32
     if (ftDevice) {
@@ -317,6 +409,7 @@ static void eshutdown(void) {
     FT_Close(ftHandle);
 #endif
     timeout_deinit();
+    ebufip = ebufil = 0;
     inited = 0;
 }
 
@@ -365,6 +458,7 @@ static int clean(void) {
 #else
     FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
 #endif
+    ebufip = ebufil = 0;
     ebufop = 0;
     return timeout_expired;
 }
@@ -382,31 +476,101 @@ static int waitb(unsigned char ec) {
 #endif
         last_ec = ec;
     }
-    for (;;) {
-#ifndef WIN32
-        int err = ftdi_read_data(ftDevice, &data, 1);
-        if (err == -ENODEV) return -ENODEV;
-        if (err < 0) return -EIO;
-        if (err == 1) {
-            break;
-        }
-#else
-        DWORD dwBytesRead;
-        FT_STATUS ftStatus = FT_Read(ftHandle, &data, 1, &dwBytesRead);
-        if (ftStatus == FT_DEVICE_NOT_FOUND) return -ENODEV;
-        if (ftStatus != FT_OK) return -ENODEV;
-        if (dwBytesRead == 1) {
-            break;
-        }
-#endif
+    while (ebufip >= ebufil) {
+        int err = refill();
+        if (err < 0) return err;
+        if (err > 0) break;
         usleep(dyntime);
         if (dyntime < 16384) dyntime <<= 1;
     }
     driver_errno = 0; timeout_expired = 0;
+    data = ebufi[ebufip++];
     crc_add_byte(data);
     return data;
 }
 
+#ifdef USB_HOTPLUG
+static int initialize_listen(int lastfail) {
+    static libusb_context *ctx;
+    static struct {
+        pid_t pid;
+        int bus, address;
+    } sessions[USB_SESSIONS];
+    libusb_hotplug_callback_handle handle;
+    int i;
+
+    inited = 0;
+
+    if (ctx == NULL) {
+        if (libusb_init(&ctx) < 0) {
+            if (lastfail != -1) log_print("Cannot initialize libusb");
+            ctx = NULL;
+            return -1;
+        }
+        if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+            if (lastfail != -2) log_print("USB hotplug is not supported on this system");
+            libusb_exit(ctx);
+            ctx = NULL;
+            return -2;
+        }
+        if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE, 0x0403, 0x6001,
+                                             LIBUSB_HOTPLUG_MATCH_ANY, hotplug, NULL, &handle) != LIBUSB_SUCCESS) {
+            if (lastfail != -2) log_print("USB hotplug is not supported on this system");
+            libusb_exit(ctx);
+            ctx = NULL;
+            return -2;
+        }
+        signal(SIGCHLD, SIG_IGN);
+        log_print("Waiting for devices");
+    }
+
+    for (;;) {
+        while (arrivals > 0) {
+            libusb_device *dev = arrived[--arrivals];
+            int bus = libusb_get_bus_number(dev), address = libusb_get_device_address(dev);
+            unsigned int k, slot = USB_SESSIONS;
+            pid_t pid;
+            libusb_unref_device(dev);
+            for (k = 0; k < USB_SESSIONS; k++) {
+                if (sessions[k].pid <= 0 || (kill(sessions[k].pid, 0) != 0 && errno == ESRCH)) {
+                    if (slot == USB_SESSIONS) slot = k;
+                    continue;
+                }
+                if (sessions[k].bus == bus && sessions[k].address == address) break;
+            }
+            if (k < USB_SESSIONS) continue;
+            if (slot == USB_SESSIONS) {
+                log_printf("Too many devices, ignored device on bus %d address %d", bus, address);
+                continue;
+            }
+            log_flush();
+            pid = fork();
+            if (pid == 0) {
+                arrivals = 0;
+                ctx = NULL;
+                signal(SIGCHLD, SIG_DFL);
+                i_bus = bus;
+                i_address = address;
+                log_printf("Session %d for device on bus %d address %d", (int)getpid(), bus, address);
+                return initialize(0);
+            }
+            if (pid < 0) {
+                log_printf("Could not fork session: %s(%d)", strerror(errno), errno);
+                continue;
+            }
+            sessions[slot].pid = pid;
+            sessions[slot].bus = bus;
+            sessions[slot].address = address;
+        }
+        i = libusb_handle_events(ctx);
+        if (i < 0 && i != LIBUSB_ERROR_INTERRUPTED) {
+            if (lastfail != -4) log_printf("Handling USB events failed: %s", libusb_error_name(i));
+            return -4;
+        }
+    }
+}
+#endif
+
 static const Driver driver = {
     .name         = "USB",
     .initialize   = initialize,
@@ -414,6 +578,24 @@ static const Driver driver = {
     .sendb        = sendb,
     .getbytes     = getbytes,
     .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
+    .shutdown     = eshutdown,
+    .flush        = flush,
+    .done         = done,
+    .turn         = turn,
+    .wait         = waitb,
+    .clean        = clean,
+};
+
+#ifdef USB_HOTPLUG
+static const Driver listen_driver = {
+    .name         = "USB listener",
+    .initialize   = initialize_listen,
+    .getb         = getb,
+    .sendb        = sendb,
+    .getbytes     = getbytes,
+    .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
     .shutdown     = eshutdown,
     .flush        = flush,
     .done         = done,
@@ -422,6 +604,21 @@ static const Driver driver = {
     .clean        = clean,
 };
 
+#endif
+
+#ifndef WIN32
+const Driver *usb_listen_driver(const char *dev) {
+    i_dev = dev;
+#ifdef USB_HOTPLUG
+    log_printf("Using %s driver for devices %s", listen_driver.name, dev != NULL ? dev : "*");
+    return &listen_driver;
+#else
+    log_print("USB hotplug is not supported by this libusb, serving a single device");
+    return usb_driver(dev);
+#endif
+}
+#endif
+
 const Driver *usb_driver(const char *dev) {
     i_dev = dev;
     log_printf("Using %s driver for device %s", driver.name, dev != NULL ? dev : "*");
@@ -28,4 +28,5 @@
 struct Driver;
 
 extern const struct Driver *usb_driver(const char *);
+extern const struct Driver *usb_listen_driver(const char *);
 #endif
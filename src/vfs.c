@@ -0,0 +1,943 @@
+/*
+
+ vfs.c - Virtual directories and cached blocks of images, archives and compressed files
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#define _GNU_SOURCE
+#include "vfs.h"
+#include "ram.h"
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifdef __MINGW32__
+#define mkdir(a, b) mkdir (a)
+#endif
+
+#ifdef VFS
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include "image.h"
+#include "archive.h"
+#include "compress.h"
+#include "log.h"
+
+#define VFS_CONTAINERS 16
+#define VFS_BLOCKS 256
+#define VFS_CACHE (16 << 20)
+#define VFS_SLOTS 256
+#define VFS_SLOT 65536
+#define VFS_SLOT_PARTS 32
+#define VFS_MAP (1 << 20)
+
+struct Vfs_dir {
+    Vfs_container *container;
+    int next;
+};
+
+typedef struct Vfs_file {
+    Vfs_container *container;
+    int entry;
+    unsigned long pos;
+} Vfs_file;
+
+static const Vfs_backend *(*const backends[])(void) = {
+    image_backend,
+    archive_backend,
+    compress_backend
+};
+
+static const Vfs_backend *backend(const char *name, size_t len) {
+    unsigned int i;
+    for (i = 0; i < sizeof backends / sizeof *backends; i++) {
+        const Vfs_backend *b = backends[i]();
+        if (b->probe(name, len)) return b;
+    }
+    return NULL;
+}
+
+int vfs_extension(const char *name, size_t len, const char *ext) {
+    size_t l = strlen(ext);
+    if (len <= l + 1 || name[len - l - 1] != '.') return 0;
+    name += len - l;
+    while (*ext) {
+        char c = *name++;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != *ext++) return 0;
+    }
+    return l + 1;
+}
+
+int vfs_container(const char *name) {
+    const Vfs_backend *b = backend(name, strlen(name));
+    return b != NULL && !b->single;
+}
+
+size_t vfs_stream(const char *name, size_t len) {
+    const Vfs_backend *b = backend(name, len);
+    if (b == NULL || !b->single) return 0;
+    return len - b->probe(name, len);
+}
+
+static unsigned int namehash(const char *name, size_t len) {
+    unsigned int h = 2166136261u;
+    while (len--) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+static int find(const Vfs_container *c, const char *name, size_t len) {
+    unsigned int i, mask = c->hashsize - 1;
+    for (i = namehash(name, len) & mask; c->hash[i] >= 0; i = (i + 1) & mask) {
+        const char *n = c->names + c->entries[c->hash[i]].name;
+        if (!memcmp(n, name, len) && n[len] == 0) return c->hash[i];
+    }
+    return -1;
+}
+
+static int rehash(Vfs_container *c) {
+    unsigned int i, size = c->hashsize ? c->hashsize * 2 : 64;
+    int *hash = (int *)malloc(size * sizeof *hash);
+    if (hash == NULL) return -1;
+    for (i = 0; i < size; i++) hash[i] = -1;
+    free(c->hash);
+    c->hash = hash;
+    c->hashsize = size;
+    for (i = 0; i < c->count; i++) {
+        const char *n = c->names + c->entries[i].name;
+        unsigned int j = namehash(n, strlen(n)) & (size - 1);
+        while (hash[j] >= 0) j = (j + 1) & (size - 1);
+        hash[j] = i;
+    }
+    return 0;
+}
+
+int vfs_add(Vfs_container *c, const char *name, size_t len, int dir, unsigned long size, time_t time) {
+    size_t p;
+    int parent = 0, i;
+    Vfs_entry *e;
+
+    while (len != 0 && name[len - 1] == '/') len--;
+    for (;;) {
+        if (len != 0 && name[0] == '/') {
+            name++; len--; continue;
+        }
+        if (len > 1 && name[0] == '.' && name[1] == '/') {
+            name += 2; len -= 2; continue;
+        }
+        break;
+    }
+    if (len == 0) return dir ? 0 : -1;
+    if (memchr(name, 0, len) != NULL) return -1;
+
+    i = find(c, name, len);
+    if (i >= 0) return (dir && c->entries[i].dir) ? i : -1;
+
+    for (p = len; p != 0; p--) {
+        if (name[p - 1] == '/') break;
+    }
+    if (p != 0) {
+        parent = vfs_add(c, name, p - 1, 1, 0, time);
+        if (parent < 0) return -1;
+        if (len == p || (name[p] == '.' && (len == p + 1 || (name[p + 1] == '.' && len == p + 2)))) return -1;
+    } else if (name[0] == '.' && (len == 1 || (name[1] == '.' && len == 2))) return -1;
+
+    if (c->count == c->capacity) {
+        unsigned int capacity = c->capacity ? c->capacity * 2 : 64;
+        e = (Vfs_entry *)realloc(c->entries, capacity * sizeof *e);
+        if (e == NULL) return -1;
+        c->entries = e;
+        c->capacity = capacity;
+    }
+    if (c->nameslen + len + 1 > c->namescapacity) {
+        unsigned long capacity = c->namescapacity ? c->namescapacity : 4096;
+        char *names;
+        while (c->nameslen + len + 1 > capacity) capacity *= 2;
+        names = (char *)realloc(c->names, capacity);
+        if (names == NULL) return -1;
+        c->names = names;
+        c->namescapacity = capacity;
+    }
+    if ((c->count + 1) * 2 > c->hashsize && rehash(c)) return -1;
+
+    i = c->count++;
+    e = c->entries + i;
+    e->name = c->nameslen;
+    memcpy(c->names + c->nameslen, name, len);
+    c->names[c->nameslen + len] = 0;
+    c->nameslen += len + 1;
+    e->size = dir ? 0 : size;
+    e->time = time;
+    e->dir = dir;
+    e->parent = parent;
+    e->child = e->last = e->next = -1;
+    e->offset = e->length = 0;
+    e->method = 0;
+    if (c->entries[parent].last >= 0) {
+        c->entries[c->entries[parent].last].next = i;
+    } else {
+        c->entries[parent].child = i;
+    }
+    c->entries[parent].last = i;
+    {
+        unsigned int j, mask = c->hashsize - 1;
+        for (j = namehash(name, len) & mask; c->hash[j] >= 0; j = (j + 1) & mask);
+        c->hash[j] = i;
+    }
+    return i;
+}
+
+static int root(Vfs_container *c, time_t time) {
+    Vfs_entry *e;
+    c->capacity = 64;
+    c->entries = (Vfs_entry *)malloc(c->capacity * sizeof *c->entries);
+    c->namescapacity = 4096;
+    c->names = (char *)malloc(c->namescapacity);
+    if (c->entries == NULL || c->names == NULL) return -1;
+    c->names[0] = 0;
+    c->nameslen = 1;
+    e = c->entries;
+    e->name = 0;
+    e->size = 0;
+    e->time = time;
+    e->dir = 1;
+    e->parent = e->child = e->last = e->next = -1;
+    e->offset = e->length = 0;
+    e->method = 0;
+    c->count = 1;
+    return rehash(c);
+}
+
+typedef struct Vfs_slot {
+    unsigned int seq;
+    unsigned long used;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime, ctime;
+    long nsec;
+    int entry;
+    unsigned long index, part;
+    size_t total, length;
+    unsigned char data[VFS_SLOT];
+} Vfs_slot;
+
+typedef struct Vfs_shared {
+    unsigned long tick;
+    Vfs_slot slots[VFS_SLOTS];
+} Vfs_shared;
+
+static Vfs_container *cache[VFS_CONTAINERS];
+static Vfs_block *blocks[VFS_BLOCKS];
+static size_t cached;
+static unsigned long tick;
+static Vfs_shared *shared;
+static sigjmp_buf bus_jump;
+static volatile sig_atomic_t bus_armed;
+
+static void bus(int x) {
+    if (bus_armed) siglongjmp(bus_jump, 1);
+    signal(x, SIG_DFL);
+}
+
+int vfs_share(void) {
+    Vfs_shared *s = (Vfs_shared *)mmap(NULL, sizeof *s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+        log_printf("Couldn't map the shared block cache: %s(%d)", strerror(errno), errno);
+        return -1;
+    }
+    shared = s;
+    return 0;
+}
+
+static int slot_match(const Vfs_slot *s, const Vfs_container *c, int entry, unsigned long index, unsigned long part) {
+    return s->used != 0 && s->dev == c->dev && s->ino == c->ino && s->size == c->size && s->mtime == c->mtime
+        && s->ctime == c->ctime && s->nsec == c->nsec
+        && s->entry == entry && s->index == index && s->part == part;
+}
+
+static Vfs_slot *slot_find(const Vfs_container *c, int entry, unsigned long index, unsigned long part, unsigned int *seq) {
+    unsigned int i;
+    for (i = 0; i < VFS_SLOTS; i++) {
+        Vfs_slot *s = &shared->slots[i];
+        *seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (!(*seq & 1) && slot_match(s, c, entry, index, part)) return s;
+    }
+    return NULL;
+}
+
+static int slot_valid(const Vfs_slot *s, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static void slot_touch(Vfs_slot *s) {
+    __atomic_store_n(&s->used, __atomic_add_fetch(&shared->tick, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+static Vfs_block *shared_get(const Vfs_container *c, int entry, unsigned long index) {
+    Vfs_slot *s;
+    Vfs_block *b;
+    unsigned int seq;
+    unsigned long part;
+    size_t total, at;
+
+    s = slot_find(c, entry, index, 0, &seq);
+    if (s == NULL) return NULL;
+    total = s->total;
+    if (!slot_valid(s, seq) || total == 0 || total > (size_t)VFS_SLOT * VFS_SLOT_PARTS) return NULL;
+    b = vfs_block_new(c, entry, index, total);
+    if (b == NULL) return NULL;
+    for (part = 0, at = 0; at < total; part++) {
+        size_t l = (total - at > VFS_SLOT) ? VFS_SLOT : total - at;
+        s = slot_find(c, entry, index, part, &seq);
+        if (s == NULL || s->total != total || s->length != l) break;
+        memcpy(b->data + at, s->data, l);
+        if (!slot_valid(s, seq)) break;
+        slot_touch(s);
+        at += l;
+    }
+    if (at == total) return b;
+    vfs_block_free(b);
+    return NULL;
+}
+
+static Vfs_slot *slot_claim(unsigned int *seq) {
+    unsigned int i, tries;
+    for (tries = 0; tries < 4; tries++) {
+        Vfs_slot *victim = NULL;
+        for (i = 0; i < VFS_SLOTS; i++) {
+            Vfs_slot *s = &shared->slots[i];
+            unsigned int sq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+            if (sq & 1) continue;
+            if (victim == NULL || s->used < victim->used) {
+                victim = s;
+                *seq = sq;
+            }
+        }
+        if (victim == NULL) return NULL;
+        if (__atomic_compare_exchange_n(&victim->seq, seq, *seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return victim;
+    }
+    return NULL;
+}
+
+void vfs_block_share(const Vfs_block *b) {
+    const Vfs_container *c = b->container;
+    unsigned int seq;
+    unsigned long part;
+    size_t at;
+
+    if (shared == NULL || b->length == 0 || b->length > (size_t)VFS_SLOT * VFS_SLOT_PARTS) return;
+    if (slot_find(c, b->entry, b->index, 0, &seq) != NULL) return;
+    for (part = 0, at = 0; at < b->length; part++) {
+        size_t l = (b->length - at > VFS_SLOT) ? VFS_SLOT : b->length - at;
+        Vfs_slot *s = slot_claim(&seq);
+        if (s == NULL) return;
+        s->dev = c->dev;
+        s->ino = c->ino;
+        s->size = c->size;
+        s->mtime = c->mtime;
+        s->ctime = c->ctime;
+        s->nsec = c->nsec;
+        s->entry = b->entry;
+        s->index = b->index;
+        s->part = part;
+        s->total = b->length;
+        s->length = l;
+        memcpy(s->data, b->data + at, l);
+        slot_touch(s);
+        __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+        at += l;
+    }
+}
+
+Vfs_block *vfs_block(const Vfs_container *c, int entry, unsigned long index) {
+    unsigned int i;
+    for (i = 0; i < VFS_BLOCKS; i++) {
+        Vfs_block *b = blocks[i];
+        if (b != NULL && b->container == c && b->entry == entry && b->index == index) {
+            b->used = ++tick;
+            return b;
+        }
+    }
+    return (shared != NULL) ? shared_get(c, entry, index) : NULL;
+}
+
+void vfs_block_free(Vfs_block *b) {
+    unsigned int i;
+    for (i = 0; i < VFS_BLOCKS; i++) {
+        if (blocks[i] != b) continue;
+        blocks[i] = NULL;
+        cached -= b->size;
+        break;
+    }
+    free(b);
+}
+
+Vfs_block *vfs_block_new(const Vfs_container *c, int entry, unsigned long index, size_t size) {
+    unsigned int i, slot, lru;
+    Vfs_block *b;
+    if (size > VFS_CACHE) return NULL;
+    for (;;) {
+        slot = lru = VFS_BLOCKS;
+        for (i = 0; i < VFS_BLOCKS; i++) {
+            if (blocks[i] == NULL) {
+                if (slot == VFS_BLOCKS) slot = i;
+            } else if (lru == VFS_BLOCKS || blocks[i]->used < blocks[lru]->used) lru = i;
+        }
+        if (slot != VFS_BLOCKS && (cached + size <= VFS_CACHE || lru == VFS_BLOCKS)) break;
+        vfs_block_free(blocks[lru]);
+    }
+    b = (Vfs_block *)malloc(sizeof *b + size);
+    if (b == NULL) return NULL;
+    b->container = c;
+    b->entry = entry;
+    b->index = index;
+    b->used = ++tick;
+    b->length = b->size = size;
+    b->data = (unsigned char *)(b + 1);
+    blocks[slot] = b;
+    cached += size;
+    return b;
+}
+
+static void blocks_free(const Vfs_container *c) {
+    unsigned int i;
+    for (i = 0; i < VFS_BLOCKS; i++) {
+        if (blocks[i] != NULL && blocks[i]->container == c) vfs_block_free(blocks[i]);
+    }
+}
+
+static void container_free(Vfs_container *c) {
+    blocks_free(c);
+    if (c->backend != NULL && c->backend->release != NULL) c->backend->release(c);
+    if (c->mapped) munmap(c->data, c->datalen); else free(c->data);
+    free(c->entries);
+    free(c->names);
+    free(c->hash);
+    free(c->path);
+    free(c);
+}
+
+static void container_put(Vfs_container *c) {
+    if (--c->refs == 0 && c->stale) container_free(c);
+}
+
+static void container_break(Vfs_container *c) {
+    unsigned int i;
+    log_printf("\"%s\" was truncated while in use", c->path);
+    blocks_free(c);
+    for (i = 0; i < VFS_CONTAINERS; i++) {
+        if (cache[i] == c) cache[i] = NULL;
+    }
+    c->stale = c->broken = 1;
+}
+
+static long nsec(const struct stat *st) {
+#ifdef __linux__
+    return st->st_mtim.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static int unchanged(const Vfs_container *c, const struct stat *st) {
+    return c->size == st->st_size && c->mtime == st->st_mtime && c->ctime == st->st_ctime && c->nsec == nsec(st);
+}
+
+static int container_parse(Vfs_container *c, const Vfs_backend *b) {
+    int ret;
+    if (c->mapped && sigsetjmp(bus_jump, 1)) {
+        bus_armed = 0;
+        log_printf("\"%s\" was truncated while loading", c->path);
+        return -1;
+    }
+    bus_armed = c->mapped;
+    ret = b->load(c);
+    bus_armed = 0;
+    return ret;
+}
+
+static Vfs_container *container_load(const char *path, const struct stat *st, const Vfs_backend *b) {
+    int fd;
+    Vfs_container *c = (Vfs_container *)calloc(1, sizeof *c);
+    if (c == NULL) return NULL;
+    c->path = strdup(path);
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->size = st->st_size;
+    c->mtime = st->st_mtime;
+    c->ctime = st->st_ctime;
+    c->nsec = nsec(st);
+    if (c->path == NULL || root(c, st->st_mtime)) {
+        container_free(c);
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        container_free(c);
+        return NULL;
+    }
+    c->datalen = st->st_size;
+    if (c->datalen >= VFS_MAP) {
+        c->data = (unsigned char *)mmap(NULL, c->datalen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (c->data != MAP_FAILED) {
+            c->mapped = 1;
+            signal(SIGBUS, bus);
+        } else c->data = NULL;
+    }
+    if (c->datalen != 0 && c->data == NULL) {
+        size_t done = 0;
+        c->data = (unsigned char *)malloc(c->datalen);
+        while (c->data != NULL && done < c->datalen) {
+            ssize_t l = pread(fd, c->data + done, c->datalen - done, done);
+            if (l <= 0) {
+                if (l < 0 && errno == EINTR) continue;
+                free(c->data);
+                c->data = NULL;
+                break;
+            }
+            done += l;
+        }
+        if (c->data == NULL) {
+            close(fd);
+            container_free(c);
+            errno = EIO;
+            return NULL;
+        }
+    }
+    close(fd);
+    if (container_parse(c, b)) {
+        log_printf("Couldn't read the directory of \"%s\"", path);
+        c->backend = NULL;
+        container_free(c);
+        errno = ENOENT;
+        return NULL;
+    }
+    c->backend = b;
+    return c;
+}
+
+static Vfs_container *container_get(const char *path, const Vfs_backend *b) {
+    struct stat st;
+    unsigned int i, slot = VFS_CONTAINERS;
+    Vfs_container *c;
+
+    if (stat(path, &st)) return NULL;
+    if (!S_ISREG(st.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    for (i = 0; i < VFS_CONTAINERS; i++) {
+        c = cache[i];
+        if (c == NULL) {
+            if (slot == VFS_CONTAINERS) slot = i;
+            continue;
+        }
+        if (c->dev != st.st_dev || c->ino != st.st_ino || strcmp(c->path, path)) continue;
+        if (unchanged(c, &st)) {
+            c->refs++;
+            c->used = ++tick;
+            return c;
+        }
+        c->stale = 1;
+        cache[i] = NULL;
+        if (c->refs == 0) container_free(c);
+        if (slot == VFS_CONTAINERS) slot = i;
+    }
+    if (slot == VFS_CONTAINERS) {
+        for (i = 0; i < VFS_CONTAINERS; i++) {
+            if (cache[i]->refs != 0) continue;
+            if (slot == VFS_CONTAINERS || cache[i]->used < cache[slot]->used) slot = i;
+        }
+    }
+    c = container_load(path, &st, b);
+    if (c == NULL) return NULL;
+    if (slot != VFS_CONTAINERS) {
+        if (cache[slot] != NULL) container_free(cache[slot]);
+        cache[slot] = c;
+    } else {
+        c->stale = 1;
+    }
+    c->refs = 1;
+    c->used = ++tick;
+    return c;
+}
+
+static Vfs_container *lookup(const char *path, int *entry) {
+    size_t i, len = strlen(path);
+    char *prefix;
+
+    for (i = 1; i <= len; i++) {
+        const Vfs_backend *b;
+        Vfs_container *c;
+        const char *inner;
+        int e;
+
+        if (i != len && path[i] != '/') continue;
+        b = backend(path, i);
+        if (b == NULL || b->single) continue;
+        prefix = (char *)malloc(i + 1);
+        if (prefix == NULL) return NULL;
+        memcpy(prefix, path, i);
+        prefix[i] = 0;
+        c = container_get(prefix, b);
+        free(prefix);
+        if (c == NULL) {
+            if (errno == ENOTDIR) continue;
+            return NULL;
+        }
+        inner = path + i;
+        while (*inner == '/') inner++;
+        len = strlen(inner);
+        while (len != 0 && inner[len - 1] == '/') len--;
+        e = len ? find(c, inner, len) : 0;
+        if (e < 0) {
+            container_put(c);
+            errno = ENOENT;
+            return NULL;
+        }
+        *entry = e;
+        return c;
+    }
+    errno = ENOTDIR;
+    return NULL;
+}
+
+Vfs_dir *vfs_opendir(const char *path) {
+    int e;
+    Vfs_dir *dir;
+    Vfs_container *c = lookup(path, &e);
+    if (c == NULL) return NULL;
+    if (!c->entries[e].dir) {
+        container_put(c);
+        errno = ENOTDIR;
+        return NULL;
+    }
+    dir = (Vfs_dir *)malloc(sizeof *dir);
+    if (dir == NULL) {
+        container_put(c);
+        return NULL;
+    }
+    dir->container = c;
+    dir->next = c->entries[e].child;
+    return dir;
+}
+
+const char *vfs_readdir(Vfs_dir *dir, int *isdir, unsigned long *size, time_t *time) {
+    const Vfs_entry *e;
+    const char *name, *slash;
+    if (dir->next < 0) return NULL;
+    e = dir->container->entries + dir->next;
+    dir->next = e->next;
+    *isdir = e->dir;
+    *size = e->size;
+    *time = e->time;
+    name = dir->container->names + e->name;
+    slash = strrchr(name, '/');
+    return slash != NULL ? slash + 1 : name;
+}
+
+void vfs_closedir(Vfs_dir *dir) {
+    container_put(dir->container);
+    free(dir);
+}
+
+static Vfs_container *stream(const char *path, int *entry) {
+    const Vfs_backend *b = backend(path, strlen(path));
+    Vfs_container *c;
+    if (b == NULL || !b->single) {
+        errno = 0;
+        return NULL;
+    }
+    c = container_get(path, b);
+    if (c == NULL) return NULL;
+    *entry = c->entries[0].child;
+    if (*entry < 0) {
+        container_put(c);
+        errno = ENOENT;
+        return NULL;
+    }
+    return c;
+}
+
+int vfs_stat(const char *path, unsigned long *size) {
+    int e;
+    struct stat st;
+    Vfs_container *c;
+    if (ram_path(path)) return ram_stat(path, size);
+    c = stream(path, &e);
+    if (c == NULL) {
+        if (errno != 0) return -1;
+        if (!stat(path, &st)) {
+            *size = st.st_size;
+            return 0;
+        }
+        if (errno != ENOTDIR) return -1;
+        c = lookup(path, &e);
+        if (c == NULL) return -1;
+    }
+    if (c->entries[e].dir) {
+        container_put(c);
+        errno = EISDIR;
+        return -1;
+    }
+    *size = c->entries[e].size;
+    container_put(c);
+    return 0;
+}
+
+static ssize_t file_read(Vfs_file *f, char *buf, size_t size) {
+    Vfs_container *c = f->container;
+    const Vfs_entry *e = c->entries + f->entry;
+    size_t l;
+    if (f->pos >= e->size) return 0;
+    if (size > e->size - f->pos) size = e->size - f->pos;
+    if (c->mapped && !c->broken && sigsetjmp(bus_jump, 1)) {
+        bus_armed = 0;
+        container_break(c);
+    }
+    if (c->broken) {
+        errno = EIO;
+        return -1;
+    }
+    bus_armed = c->mapped;
+    l = c->backend->read(c, e, f->pos, (unsigned char *)buf, size);
+    bus_armed = 0;
+    f->pos += l;
+    return l;
+}
+
+static int file_seek(Vfs_file *f, long long *offset, int whence) {
+    long long pos = *offset;
+    switch (whence) {
+    case SEEK_SET: break;
+    case SEEK_CUR: pos += f->pos; break;
+    case SEEK_END: pos += f->container->entries[f->entry].size; break;
+    default: errno = EINVAL; return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+static int file_close(Vfs_file *f) {
+    container_put(f->container);
+    free(f);
+    return 0;
+}
+
+#ifdef __GLIBC__
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+    return file_read((Vfs_file *)cookie, buf, size);
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+    long long pos = *offset;
+    if (file_seek((Vfs_file *)cookie, &pos, whence)) return -1;
+    *offset = pos;
+    return 0;
+}
+
+static int cookie_close(void *cookie) {
+    return file_close((Vfs_file *)cookie);
+}
+
+static FILE *file_stream(Vfs_file *f) {
+    cookie_io_functions_t io = {cookie_read, NULL, cookie_seek, cookie_close};
+    return fopencookie(f, "rb", io);
+}
+#else
+static int cookie_read(void *cookie, char *buf, int size) {
+    return file_read((Vfs_file *)cookie, buf, size);
+}
+
+static fpos_t cookie_seek(void *cookie, fpos_t offset, int whence) {
+    long long pos = offset;
+    if (file_seek((Vfs_file *)cookie, &pos, whence)) return -1;
+    return pos;
+}
+
+static int cookie_close(void *cookie) {
+    return file_close((Vfs_file *)cookie);
+}
+
+static FILE *file_stream(Vfs_file *f) {
+    return funopen(f, cookie_read, NULL, cookie_seek, cookie_close);
+}
+#endif
+
+FILE *vfs_fopen(const char *path, int *fd) {
+    FILE *file;
+    Vfs_file *f;
+    int e;
+    Vfs_container *c;
+
+    *fd = -1;
+    if (ram_path(path)) return ram_fopen(path, O_RDONLY);
+    c = stream(path, &e);
+    if (c == NULL) {
+        if (errno != 0) return NULL;
+        *fd = open(path, O_RDONLY | O_BINARY, 0);
+        if (*fd >= 0) {
+            file = fdopen(*fd, "rb");
+            if (file == NULL) {
+                close(*fd);
+                *fd = -1;
+            }
+            return file;
+        }
+        if (errno != ENOTDIR) return NULL;
+        c = lookup(path, &e);
+        if (c == NULL) return NULL;
+    }
+    if (c->entries[e].dir) {
+        container_put(c);
+        errno = EISDIR;
+        return NULL;
+    }
+    f = (Vfs_file *)malloc(sizeof *f);
+    if (f == NULL) {
+        container_put(c);
+        return NULL;
+    }
+    f->container = c;
+    f->entry = e;
+    f->pos = 0;
+    file = file_stream(f);
+    if (file == NULL) file_close(f);
+    return file;
+}
+#else
+int vfs_add(Vfs_container *c, const char *name, size_t len, int dir, unsigned long size, time_t time) {
+    (void)c; (void)name; (void)len; (void)dir; (void)size; (void)time;
+    return -1;
+}
+
+int vfs_extension(const char *name, size_t len, const char *ext) {
+    (void)name; (void)len; (void)ext;
+    return 0;
+}
+
+int vfs_container(const char *name) {
+    (void)name;
+    return 0;
+}
+
+Vfs_dir *vfs_opendir(const char *path) {
+    (void)path;
+    errno = ENOTDIR;
+    return NULL;
+}
+
+const char *vfs_readdir(Vfs_dir *dir, int *isdir, unsigned long *size, time_t *time) {
+    (void)dir; (void)isdir; (void)size; (void)time;
+    return NULL;
+}
+
+void vfs_closedir(Vfs_dir *dir) {
+    (void)dir;
+}
+
+size_t vfs_stream(const char *name, size_t len) {
+    (void)name; (void)len;
+    return 0;
+}
+
+int vfs_share(void) {
+    return -1;
+}
+
+int vfs_stat(const char *path, unsigned long *size) {
+    struct stat st;
+    if (stat(path, &st)) return -1;
+    *size = st.st_size;
+    return 0;
+}
+
+FILE *vfs_fopen(const char *path, int *fd) {
+    *fd = open(path, O_RDONLY | O_BINARY, 0);
+    if (*fd < 0) return NULL;
+    return fdopen(*fd, "rb");
+}
+#endif
+
+FILE *vfs_fopenw(const char *path, int flags, int *fd) {
+    FILE *file;
+    *fd = -1;
+    if (ram_path(path)) return ram_fopen(path, flags);
+#ifndef WIN32
+    *fd = open(path, flags | O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#else
+    *fd = open(path, flags | O_BINARY, S_IRUSR | S_IWUSR);
+#endif
+    if (*fd < 0) return NULL;
+    file = fdopen(*fd, ((flags & O_ACCMODE) == O_WRONLY) ? "wb" : "rb+");
+    if (file == NULL) {
+        close(*fd);
+        *fd = -1;
+    }
+    return file;
+}
+
+int vfs_ftruncate(FILE *file, int fd, unsigned long length) {
+    return (fd >= 0) ? ftruncate(fd, length) : ram_ftruncate(file, length);
+}
+
+int vfs_mkdir(const char *path) {
+    return ram_path(path) ? ram_mkdir(path) : mkdir(path, 0777);
+}
+
+int vfs_rmdir(const char *path) {
+    return ram_path(path) ? ram_rmdir(path) : rmdir(path);
+}
+
+int vfs_unlink(const char *path) {
+    return ram_path(path) ? ram_unlink(path) : unlink(path);
+}
+
+int vfs_rename(const char *from, const char *to, int replace) {
+    if (ram_path(from) || ram_path(to)) {
+        if (ram_path(from) && ram_path(to)) return ram_rename(from, to, replace);
+        errno = EXDEV;
+        return -1;
+    }
+#ifdef RENAME_NOREPLACE
+    if (!replace) {
+        int r = renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE);
+        if (r == 0 || (errno != EINVAL && errno != ENOSYS)) return r;
+    }
+#else
+    (void)replace;
+#endif
+    return rename(from, to);
+}
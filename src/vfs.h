@@ -0,0 +1,106 @@
+/*
+
+ vfs.h
+
+    This file is part of IDEDOS the IDE64 disk operating system
+    See README for copyright notice.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef _VFS_H
+#define _VFS_H
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#if defined __GLIBC__ || defined OSX || defined __FreeBSD__ || defined __NetBSD__ || defined __OpenBSD__
+#define VFS
+#endif
+
+typedef struct Vfs_entry {
+    unsigned long name;
+    unsigned long size;
+    time_t time;
+    int dir;
+    int parent, child, last, next;
+    unsigned long offset, length;
+    int method;
+} Vfs_entry;
+
+struct Vfs_backend;
+
+typedef struct Vfs_container {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime, ctime;
+    long nsec;
+    const struct Vfs_backend *backend;
+    unsigned char *data;
+    size_t datalen;
+    int mapped;
+    Vfs_entry *entries;
+    unsigned int count, capacity;
+    char *names;
+    unsigned long nameslen, namescapacity;
+    int *hash;
+    unsigned int hashsize;
+    void *priv;
+    unsigned int refs;
+    unsigned long used;
+    int stale, broken;
+} Vfs_container;
+
+typedef struct Vfs_backend {
+    int (*probe)(const char *, size_t);
+    int (*load)(Vfs_container *);
+    size_t (*read)(Vfs_container *, const Vfs_entry *, unsigned long, unsigned char *, size_t);
+    void (*release)(Vfs_container *);
+    int single;
+} Vfs_backend;
+
+typedef struct Vfs_block {
+    const Vfs_container *container;
+    int entry;
+    unsigned long index;
+    unsigned long used;
+    size_t length, size;
+    unsigned char *data;
+} Vfs_block;
+
+typedef struct Vfs_dir Vfs_dir;
+
+extern int vfs_add(Vfs_container *, const char *, size_t, int, unsigned long, time_t);
+extern int vfs_extension(const char *, size_t, const char *);
+extern Vfs_block *vfs_block(const Vfs_container *, int, unsigned long);
+extern Vfs_block *vfs_block_new(const Vfs_container *, int, unsigned long, size_t);
+extern void vfs_block_free(Vfs_block *);
+extern void vfs_block_share(const Vfs_block *);
+extern int vfs_share(void);
+extern int vfs_container(const char *);
+extern size_t vfs_stream(const char *, size_t);
+extern Vfs_dir *vfs_opendir(const char *);
+extern const char *vfs_readdir(Vfs_dir *, int *, unsigned long *, time_t *);
+extern void vfs_closedir(Vfs_dir *);
+extern int vfs_stat(const char *, unsigned long *);
+extern FILE *vfs_fopen(const char *, int *);
+extern FILE *vfs_fopenw(const char *, int, int *);
+extern int vfs_ftruncate(FILE *, int, unsigned long);
+extern int vfs_mkdir(const char *);
+extern int vfs_rmdir(const char *);
+extern int vfs_unlink(const char *);
+extern int vfs_rename(const char *, const char *, int);
+#endif
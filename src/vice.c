@@ -34,12 +34,17 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <signal.h>
 #endif
 
 #include "eth.h"
 #include "crc8.h"
 #include "log.h"
 #include "driver.h"
+#include "memrev.h"
+#include "ideservd.h"
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
@@ -47,9 +52,14 @@
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 64245
+#define UNIX_PREFIX "unix:"
+#define SOCKET_BUFFER 262144
 
 static int sock = -1;
-static unsigned char ebufi[1024], ebufo[1024];
+#ifndef __MINGW32__
+static int listener = -1;
+#endif
+static unsigned char ebufi[16384], ebufo[16384];
 static unsigned int ebufip, ebufop, ebufil;
 static struct hostent *hp;
 static const char *i_addr;
@@ -73,6 +83,41 @@ static const wchar_t *wsaerror(int wsaerrno) {
 
 static int flush(void);
 
+#ifndef __MINGW32__
+static int initialize_unix(int lastfail) {
+    struct sockaddr_un eserver;
+    const char *path = i_addr + strlen(UNIX_PREFIX);
+    int size = SOCKET_BUFFER;
+
+    inited = 0;
+
+    if (strlen(path) >= sizeof eserver.sun_path) {
+        if (lastfail != -1) log_printf("Socket path %s too long", path);
+        return -1;
+    }
+    memset(&eserver, 0, sizeof eserver);
+    eserver.sun_family = AF_UNIX;
+    strcpy(eserver.sun_path, path);
+
+    if (sock < 0) sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        if (lastfail != -2) log_printf("Cannot open socket: %s(%d)", strerror(errno), errno);
+        return -2;
+    }
+    if (connect(sock, (struct sockaddr *)&eserver, sizeof eserver) < 0) {
+        if (lastfail != -3) log_printf("Cannot connect to %s: %s(%d)", path, strerror(errno), errno);
+        return -3;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof size) < 0 || setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) < 0) {
+        log_printf("Setting socket options failed: %s(%d)", strerror(errno), errno);
+    }
+
+    log_printf("Connected to %s", path);
+    inited = 1;
+    return 0;
+}
+#endif
+
 static int initialize(int lastfail) {
     struct sockaddr_in eserver;
 #ifdef __MINGW32__
@@ -89,6 +134,8 @@ static int initialize(int lastfail) {
     }
 #else
     int tr = 1;
+
+    if (!strncmp(i_addr, UNIX_PREFIX, strlen(UNIX_PREFIX))) return initialize_unix(lastfail);
 #endif
 
     inited = 0;
@@ -140,6 +187,101 @@ static int initialize(int lastfail) {
     return 0;
 }
 
+#ifndef __MINGW32__
+static int open_listener(int lastfail) {
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    } eserver;
+    socklen_t len;
+    int tr = 1;
+
+    memset(&eserver, 0, sizeof eserver);
+    if (!strncmp(i_addr, UNIX_PREFIX, strlen(UNIX_PREFIX))) {
+        const char *path = i_addr + strlen(UNIX_PREFIX);
+        if (strlen(path) >= sizeof eserver.un.sun_path) {
+            if (lastfail != -1) log_printf("Socket path %s too long", path);
+            return -1;
+        }
+        eserver.un.sun_family = AF_UNIX;
+        strcpy(eserver.un.sun_path, path);
+        unlink(path);
+        len = sizeof eserver.un;
+    } else {
+        if (!hp) hp = gethostbyname(i_addr);
+        if (!hp) {
+            if (lastfail != -1) log_printf("Hostname %s not found", i_addr);
+            return -1;
+        }
+        eserver.in.sin_family = AF_INET;
+        memcpy(&eserver.in.sin_addr.s_addr, hp->h_addr, sizeof eserver.in.sin_addr.s_addr);
+        eserver.in.sin_port = htons(i_port);
+        len = sizeof eserver.in;
+    }
+
+    listener = socket(((struct sockaddr *)&eserver)->sa_family, SOCK_STREAM, 0);
+    if (listener < 0) {
+        if (lastfail != -2) log_printf("Cannot open socket: %s(%d)", strerror(errno), errno);
+        return -2;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &tr, sizeof tr);
+    if (bind(listener, (struct sockaddr *)&eserver, len) < 0 || listen(listener, SOMAXCONN) < 0) {
+        if (lastfail != -3) log_printf("Cannot listen on %s: %s(%d)", i_addr, strerror(errno), errno);
+        close(listener);
+        listener = -1;
+        return -3;
+    }
+    signal(SIGCHLD, SIG_IGN);
+    log_print("Waiting for connections");
+    return 0;
+}
+
+static int initialize_listen(int lastfail) {
+    inited = 0;
+
+    if (listener < 0) {
+        int i = open_listener(lastfail);
+        if (i != 0) return i;
+#ifndef WIN32
+        drop_privileges(0);
+#endif
+    }
+
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof peer;
+        pid_t pid;
+        int tr = 1;
+        int s = accept(listener, (struct sockaddr *)&peer, &len);
+        if (s < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (lastfail != -4) log_printf("Cannot accept connection: %s(%d)", strerror(errno), errno);
+            return -4;
+        }
+        log_flush();
+        pid = fork();
+        if (pid == 0) {
+            close(listener);
+            listener = -1;
+            signal(SIGCHLD, SIG_DFL);
+            sock = s;
+            if (peer.sin_family == AF_INET) {
+                if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &tr, sizeof tr) < 0) {
+                    log_printf("Setting socket options failed: %s(%d)", strerror(errno), errno);
+                }
+                log_printf("Session %d connected from %s:%d", (int)getpid(), inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+            } else {
+                log_printf("Session %d connected", (int)getpid());
+            }
+            inited = 1;
+            return 0;
+        }
+        if (pid < 0) log_printf("Could not fork session: %s(%d)", strerror(errno), errno);
+        close(s);
+    }
+}
+#endif
+
 static int refill(void) {
     if (driver_errno == 0) {
         int n = recv(sock, (char *)ebufi, sizeof ebufi, MSG_NOSIGNAL);
@@ -199,10 +341,29 @@ static void sendbytes(const unsigned char data[], unsigned int bytes) {
     ebufop += bytes;
 }
 
+static void sendrbytes(const unsigned char data[], unsigned int bytes) {
+    while (ebufop + bytes > sizeof ebufo) {
+        unsigned int l = sizeof(ebufo) - ebufop;
+        bytes -= l;
+        memrevcpy(ebufo + ebufop, data + bytes, l);
+        crc_add_block(ebufo + ebufop, l);
+        ebufop = sizeof ebufo;
+        driver_errno = flush();
+        if (driver_errno != 0) return;
+    }
+    memrevcpy(ebufo + ebufop, data, bytes);
+    crc_add_block(ebufo + ebufop, bytes);
+    ebufop += bytes;
+}
+
 static void eshutdown(void) {
     if (sock >= 0) close(sock);
     sock = -1;
     inited = 0;
+#ifndef __MINGW32__
+    if (listener >= 0) close(listener);
+    listener = -1;
+#endif
 
 #ifdef __MINGW32__
     if (wsainited == 1) {
@@ -254,6 +415,24 @@ static const Driver driver = {
     .sendb        = sendb,
     .getbytes     = getbytes,
     .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
+    .shutdown     = eshutdown,
+    .flush        = flush,
+    .done         = done,
+    .turn         = turn,
+    .wait         = waitb,
+    .clean        = clean,
+};
+
+#ifndef __MINGW32__
+static const Driver listen_driver = {
+    .name         = "VICE listener",
+    .initialize   = initialize_listen,
+    .getb         = getb,
+    .sendb        = sendb,
+    .getbytes     = getbytes,
+    .sendbytes    = sendbytes,
+    .sendrbytes   = sendrbytes,
     .shutdown     = eshutdown,
     .flush        = flush,
     .done         = done,
@@ -262,9 +441,27 @@ static const Driver driver = {
     .clean        = clean,
 };
 
+const Driver *vice_listen_driver(const char *addr, int port) {
+    i_addr = addr != NULL ? addr : SERVER_IP;
+    i_port = port != 0 ? port : SERVER_PORT;
+    if (!strncmp(i_addr, UNIX_PREFIX, strlen(UNIX_PREFIX))) {
+        log_printf("Using %s driver on %s", listen_driver.name, i_addr);
+        return &listen_driver;
+    }
+    log_printf("Using %s driver on %s:%d", listen_driver.name, i_addr, i_port);
+    return &listen_driver;
+}
+#endif
+
 const Driver *vice_driver(const char *addr, int port) {
     i_addr = addr != NULL ? addr : SERVER_IP;
     i_port = port != 0 ? port : SERVER_PORT;
+#ifndef __MINGW32__
+    if (!strncmp(i_addr, UNIX_PREFIX, strlen(UNIX_PREFIX))) {
+        log_printf("Using %s driver connecting to %s", driver.name, i_addr);
+        return &driver;
+    }
+#endif
     log_printf("Using %s driver connecting to %s:%d", driver.name, i_addr, i_port);
     return &driver;
 }
@@ -28,4 +28,5 @@
 struct Driver;
 
 extern const struct Driver *vice_driver(const char *, int);
+extern const struct Driver *vice_listen_driver(const char *, int);
 #endif